@@ -56,6 +56,8 @@ int main(void)
         UnloadImage(img);
     }
 
+    // The library no longer seeds rand(), so seed it here for the point jitter
+    srand(time(NULL));
     GeneratePoints();
     StartWFC();
 
@@ -90,7 +92,7 @@ int main(void)
             }
             WFC_Run(&wfc);
 
-            TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d", wfc.totalIterations, wfc.totalObservations, wfc.totalPropagations, wfc.totalResets));
+            TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d | Backtracks: %d", wfc.totalIterations, wfc.totalObservations, wfc.totalPropagations, wfc.totalResets, wfc.totalBacktracks));
             autostep = false;
             timer = stepDelay;
         }
@@ -106,7 +108,7 @@ int main(void)
 
             if (wfc.isFinished)
             {
-                TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d", wfc.totalIterations, wfc.totalObservations, wfc.totalPropagations, wfc.totalResets));
+                TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d | Backtracks: %d", wfc.totalIterations, wfc.totalObservations, wfc.totalPropagations, wfc.totalResets, wfc.totalBacktracks));
             }
             autostep = false;
             timer = stepDelay;
@@ -121,7 +123,7 @@ int main(void)
 
                 if (wfc.isFinished)
                 {
-                    TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d", wfc.totalIterations, wfc.totalObservations, wfc.totalPropagations, wfc.totalResets));
+                    TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d | Backtracks: %d", wfc.totalIterations, wfc.totalObservations, wfc.totalPropagations, wfc.totalResets, wfc.totalBacktracks));
                     autostep = false;
                     timer = stepDelay;
                 }
@@ -147,28 +149,27 @@ int main(void)
             if (CheckCollisionPointCircle(GetMousePosition(), points[i], 15))
             {
                 std::stringstream desc {};
-                desc << "Cell " << i << ": Neighbors: " << wfc.wave[i].neighborCount;
+                desc << "Cell " << i << ": Neighbors: " << WFC_NeighborCount(&wfc, i);
                 desc << " - Valid Tiles: { ";
                 for (int t = 0; t < wfc.tileCount; t++)
                 {
-                    if (wfc.wave[i].validTiles[t])
+                    if (WFC_IsTileValid(&wfc, i, t))
                         desc << tileset[t].name << ", ";
                 }
-                desc << " } - Collapsed? " << wfc.wave[i].isCollapsed;
-                // DrawText(TextFormat("Cell %d: Neighbors: %d - Valid Tiles: %d - Collapsed? %s", i, wfc.wave[i].neighborCount, wfc.wave[i].validTileCount, 
-                                    // wfc.wave[i].isCollapsed ? "Yes" : "No"), 20, screenHeight-20, 10, BLACK);
+                desc << " } - Collapsed? " << WFC_GetCell(&wfc, i).isCollapsed;
+                // DrawText(TextFormat("Cell %d: Neighbors: %d - Valid Tiles: %d - Collapsed? %s", i, WFC_NeighborCount(&wfc, i), WFC_GetCell(&wfc, i).validTileCount, 
+                                    // WFC_GetCell(&wfc, i).isCollapsed ? "Yes" : "No"), 20, screenHeight-20, 10, BLACK);
                 std::string descStr = desc.str();
                 DrawText(descStr.c_str(), 20, screenHeight-20, 10, BLACK);
 
-                for (int n = 0; n < wfc.wave[i].neighborCount; n++)
+                for (int n = 0; n < WFC_NeighborCount(&wfc, i); n++)
                 {
-                    // std::cout << wfc.wave[i].neighborCount << '\n';
-                    DrawCircleLinesV(points[wfc.wave[i].neighbors[n].idx], 24, BLUE);
+                    DrawCircleLinesV(points[WFC_GetNeighbor(&wfc, i, n)], 24, BLUE);
                 }
             }
-            if (wfc.wave[i].isCollapsed)
+            if (WFC_GetCell(&wfc, i).isCollapsed)
                 DrawTexturePro(
-                    tileset[wfc.wave[i].collapsedTile].tex,
+                    tileset[WFC_GetCell(&wfc, i).collapsedTile].tex,
                     {0, 0, svgSize, svgSize},
                     {points[i].x, points[i].y, svgSize * 0.3f, svgSize * 0.3f},
                     {svgSize * 0.3f/2,svgSize * 0.3f/2},
@@ -177,7 +178,7 @@ int main(void)
                     );
             else
                 DrawCircleV(points[i], svgSize * 0.3f/2, BLACK);
-            // DrawCircleV(points[i], 10, tileColors[wfc.wave[i].collapsedTile]);
+            // DrawCircleV(points[i], 10, tileColors[WFC_GetCell(&wfc, i).collapsedTile]);
         }
         EndDrawing();
     }
@@ -280,16 +281,17 @@ void StartWFC()
     WFC_Init(&wfc, tiles, 6, 1);
 
     // Add points
-    for (auto& p : points)
-    {
-        WFC_AddCell(&wfc);
-    }
+    WFC_AddCells(&wfc, points.size());
 
     // Connect each point to the point in the neighboring grid cell
+    std::vector<int> from, to, rels;
     for (auto neighbor : neighbors)
     {
-        WFC_AddNeighbor(&wfc, neighbor.first, neighbor.second, 0);
+        from.push_back(neighbor.first);
+        to.push_back(neighbor.second);
+        rels.push_back(0);
     }
+    WFC_AddEdges(&wfc, from.data(), to.data(), rels.data(), from.size());
 
     // WFC_SetRule(&wfc, tiles[0], tiles[0], 0, true);
     // WFC_SetRule(&wfc, tiles[0], tiles[1], 0, true);
@@ -330,5 +332,8 @@ void StartWFC()
     WFC_SetRule(&wfc, tiles[5], tiles[1], 0, true);
     WFC_SetRule(&wfc, tiles[5], tiles[4], 0, true);
 
+    // The map has a single door, the entrance
+    WFC_AddTileLimit(&wfc, -1, 5, 1, 1);
+
     WFC_SetTileTo(&wfc, 0, 5);
 }
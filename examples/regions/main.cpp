@@ -97,7 +97,7 @@ int main(void)
             }
             map->Generate();
 
-            TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d", map->wfc.totalIterations, map->wfc.totalObservations, map->wfc.totalPropagations, map->wfc.totalResets));
+            TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d | Backtracks: %d", map->wfc.totalIterations, map->wfc.totalObservations, map->wfc.totalPropagations, map->wfc.totalResets, map->wfc.totalBacktracks));
             autostep = false;
             timer = stepDelay;
         }
@@ -111,7 +111,7 @@ int main(void)
 
             if (map->wfc.isFinished)
             {
-                TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d", map->wfc.totalIterations, map->wfc.totalObservations, map->wfc.totalPropagations, map->wfc.totalResets));
+                TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d | Backtracks: %d", map->wfc.totalIterations, map->wfc.totalObservations, map->wfc.totalPropagations, map->wfc.totalResets, map->wfc.totalBacktracks));
             }
             autostep = false;
             timer = stepDelay;
@@ -126,7 +126,7 @@ int main(void)
 
                 if (map->wfc.isFinished)
                 {
-                    TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d", map->wfc.totalIterations, map->wfc.totalObservations, map->wfc.totalPropagations, map->wfc.totalResets));
+                    TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d | Backtracks: %d", map->wfc.totalIterations, map->wfc.totalObservations, map->wfc.totalPropagations, map->wfc.totalResets, map->wfc.totalBacktracks));
                     autostep = false;
                     timer = stepDelay;
                 }
@@ -231,47 +231,21 @@ void Map::GenerateRandomRegions(int regionNumber)
 void Map::StartWFC() {
     using rel = Tileset::Relationships;
     
-    WFC_Init(&wfc, tileset.GetWFCTiles(), tileset.GetTileCount(), rel::OTHER_REGION+1);
+    WFC_Init(&wfc, tileset.GetWFCTiles(), tileset.GetTileCount(), rel::RIGHT+1);
 
-    for (int y = 0; y < height; y++)
+    // The grid neighbors are implicit
+    WFC_Grid grid = { width, height, 1, { false, false, false }, { rel::LEFT, rel::RIGHT, rel::UP, rel::DOWN, -1, -1 } };
+    WFC_SetGrid(&wfc, &grid);
+
+    // Each region is a group, so the region rules cost one membership per cell instead of an edge per pair of cells
+    for (int r = 0; r < regions.size(); r++)
     {
-        for (int x = 0; x < width; x++)
-        {
-            int idx = WFC_AddCell(&wfc);
-            int reg = data[idx].region;
-
-            if (x > 0)
-                WFC_AddNeighbor(&wfc, idx, idx - 1, rel::LEFT);
-            
-            if (y > 0)
-                WFC_AddNeighbor(&wfc, idx, idx - width, rel::UP);
-            
-            if (x < width - 1)
-                WFC_AddNeighbor(&wfc, idx, idx + 1, rel::RIGHT);
-
-            if (y < height - 1)
-                WFC_AddNeighbor(&wfc, idx, idx + width, rel::DOWN);
-        }
+        WFC_AddGroup(&wfc);
     }
 
-    for (int i1 = 0; i1 < width * height; i1++)
+    for (int i = 0; i < width * height; i++)
     {
-        for (int i2 = i1 + 1; i2 < width * height; i2++)
-        {
-            if (data[i1].region == data[i2].region)
-            {
-                // if (i1 + 1 != i2 && i1 - 1 != i2 && i1 + width != i2 && i1 - width != i2)
-                // {
-                    WFC_AddNeighbor(&wfc, i1, i2, rel::SAME_REGION);
-                    WFC_AddNeighbor(&wfc, i2, i1, rel::SAME_REGION);
-                // }
-            }
-            else
-            {
-                WFC_AddNeighbor(&wfc, i1, i2, rel::OTHER_REGION);
-                WFC_AddNeighbor(&wfc, i2, i1, rel::OTHER_REGION);
-            }
-        }
+        WFC_AddToGroup(&wfc, data[i].region, i);
     }
 
     tileset.ConfigureWFC(&wfc);
@@ -288,7 +262,7 @@ void Map::Generate()
 
     for (int i = 0; i < data.size(); i++)
     {
-        data[i].tile = wfc.wave[i].collapsedTile;
+        data[i].tile = WFC_GetCell(&wfc, i).collapsedTile;
     }
 }
 
@@ -301,7 +275,7 @@ void Map::Draw(float x, float y, float scale, bool drawRegions)
     {
         int tx = tile % width;
         int ty = tile / width;
-        WFC_Cell& cell = wfc.wave[tile];
+        WFC_Cell cell = WFC_GetCell(&wfc, tile);
 
         Rectangle tileBounds { x + tx * tileSize * scale, y + ty * tileSize * scale, tileSize * scale, tileSize * scale};
 
@@ -317,13 +291,13 @@ void Map::Draw(float x, float y, float scale, bool drawRegions)
 
         if (CheckCollisionPointRec(GetMousePosition(), tileBounds))
         {
-            DrawText(TextFormat("Tile %d: %d neighbors, %d valid tiles, entropy: %3f, collapsed to %d", cell.idx, cell.neighborCount, cell.validTileCount, log(cell.sumWeights) - cell.weightLogWeightSum / cell.sumWeights, cell.collapsedTile),
+            DrawText(TextFormat("Tile %d: %d neighbors, %d valid tiles, entropy: %3f, collapsed to %d", cell.idx, WFC_NeighborCount(&wfc, cell.idx), cell.validTileCount, log(cell.sumWeights) - cell.weightLogWeightSum / cell.sumWeights, cell.collapsedTile),
                      100, 400, 10, BLACK);
             if (IsKeyPressed(KEY_F))
             {
                 for (int t = 0; t < wfc.tileCount; t++)
                 {
-                    if (!cell.validTiles[t]) continue;
+                    if (!WFC_IsTileValid(&wfc, tile, t)) continue;
 
                     TraceLog(LOG_INFO, TextFormat("%s", tileset.tiles[t].name.c_str()));
                 }
@@ -5,6 +5,7 @@
 
 #include <string_view>
 #include <iostream>
+#include <map>
 #include <string>
 #include <sstream>
 #include <vector>
@@ -16,6 +17,7 @@ struct TileData {
     float u, v;
     bool unique;
     bool one_per_region;
+    bool connected;
     std::string slots[4];
     const std::string name;
     const std::string group;
@@ -28,8 +30,6 @@ public:
         DOWN,
         LEFT,
         RIGHT,
-        SAME_REGION,
-        OTHER_REGION,
     };
 
     Tileset(const char* path);
@@ -62,6 +62,7 @@ inline Tileset::Tileset(const char* path) {
         tile.u = tileTable[toml::path ("uv")][0].value_or(0.f);
         tile.v = tileTable[toml::path ("uv")][1].value_or(0.f);
         tile.unique = tileTable[toml::path ("unique")].value_or(false);
+        tile.connected = tileTable[toml::path ("connected")].value_or(false);
         tile.slots[0] =  tileTable[toml::path ("slot_up")].value_or("");
         tile.slots[1] = tileTable[toml::path ("slot_down")].value_or("");
         tile.slots[2] = tileTable[toml::path ("slot_left")].value_or("");
@@ -100,6 +101,7 @@ inline Tileset::Tileset(const char* path) {
                 std::cout << "Group: " << tilename << '\n';
 
                 bool one_per_region = tiledata[toml::path ("one_per_region")].value_or(false);
+                bool connected = tiledata[toml::path ("connected")].value_or(false);
 
                 for (auto [groupedTile, gTileData] : tiledata.ref<toml::table>())
                 {
@@ -110,6 +112,7 @@ inline Tileset::Tileset(const char* path) {
                     int idx = RegisterTile(std::string(groupedTile), std::string (tilename), gTileData.ref<toml::table>());
 
                     tiles[idx].one_per_region = one_per_region;
+                    tiles[idx].connected |= connected;
                 }
             }
         }
@@ -125,11 +128,34 @@ inline void Tileset::ConfigureWFC(WFC_State* wfc)
     if (wfc == NULL || !wfc->initialized)
         return;
 
+    // Each rule also defines its mirror in the opposite direction
+    WFC_SetInverse(wfc, UP, DOWN);
+    WFC_SetInverse(wfc, LEFT, RIGHT);
+
+    // Each region is a group of cells, so region rules are group rules:
+    // 1) "one per region" groups of tiles allow only one of their tiles in each region. That tile can repeat.
+    // 2) "unique" tiles only appear in one region.
+    // "connected" tiles must all form a single network, like the roads.
+    std::map<std::string, std::vector<int>> onePerRegion;
+    std::vector<int> uniqueTiles, connectedTiles;
+    for (int tIdx = 0; tIdx < tiles.size(); tIdx++)
+    {
+        if (tiles[tIdx].one_per_region)
+            onePerRegion[tiles[tIdx].group].push_back(tIdx);
+        if (tiles[tIdx].unique)
+            uniqueTiles.push_back(tIdx);
+        if (tiles[tIdx].connected)
+            connectedTiles.push_back(tIdx);
+    }
+
+    for (const auto& [group, groupTiles] : onePerRegion)
+        WFC_AddGroupRule(wfc, WFC_GROUP_EXCLUSIVE, groupTiles.data(), groupTiles.size());
+    if (!uniqueTiles.empty())
+        WFC_AddGroupRule(wfc, WFC_GROUP_SINGLE, uniqueTiles.data(), uniqueTiles.size());
+    if (!connectedTiles.empty())
+        WFC_AddConnectivity(wfc, connectedTiles.data(), connectedTiles.size(), -1, 1 << UP | 1 << DOWN | 1 << LEFT | 1 << RIGHT);
+
     // Compares every tile to match slots.
-    // When it comes to SAME_REGION and OTHER_REGION:
-    // 1) The same tile should allow itself in the same region.
-    // 2) The same tile should only allow itself in other regions if it's not unique.
-    // 3) All tiles should allow all other tiles in other regions.
     for (int t1Idx = 0; t1Idx < tiles.size(); t1Idx++)
     {
         for (int t2Idx = t1Idx; t2Idx < tiles.size(); t2Idx++)
@@ -141,24 +167,9 @@ inline void Tileset::ConfigureWFC(WFC_State* wfc)
             // the "one per region" rule should only apply for tiles of the same group, and we don't want to block the same tile from appearing again in the same region if it's "one per region".
             bool limit_per_region = ((t1.one_per_region || t2.one_per_region ) && t1.group == t2.group && t1Idx != t2Idx);
 
-            WFC_SetRule(wfc, Tile {t1Idx, 0}, Tile {t2Idx, 0}, SAME_REGION, !limit_per_region);
-            WFC_SetRule(wfc, Tile {t2Idx, 0}, Tile {t1Idx, 0}, SAME_REGION, !limit_per_region);
-
-            if (t1Idx == t2Idx)
-            {
-                // "unique" tiles do not allow themselves to appear in any other region. so we set this rule to false if unique
-                WFC_SetRule(wfc, Tile {t1Idx, 0}, Tile {t2Idx, 0}, OTHER_REGION, !tiles[t1Idx].unique);
-            }
-            else
-            {
-                // all tiles by default should allow all others in other regions.
-                WFC_SetRule(wfc, Tile {t1Idx, 0}, Tile {t2Idx, 0}, OTHER_REGION, true);
-                WFC_SetRule(wfc, Tile {t2Idx, 0}, Tile {t1Idx, 0}, OTHER_REGION, true);
-
-                // if any of the two tiles are "one per region", we continue here to avoid accidentally allowing them to exist adjacent to one another in the direction loop below
-                if (limit_per_region)
-                    continue;
-            }
+            // if any of the two tiles are "one per region", we continue here to avoid accidentally allowing them to exist adjacent to one another in the direction loop below
+            if (limit_per_region)
+                continue;
 
             for (int d = 0; d < 4; d++)
             {
@@ -213,7 +224,6 @@ inline void Tileset::ConfigureWFC(WFC_State* wfc)
                 if (hasCommonEl)
                 {
                     WFC_SetRule(wfc, Tile {t1Idx, 0}, Tile {t2Idx, 0}, d, true);
-                    WFC_SetRule(wfc, Tile {t2Idx, 0}, Tile {t1Idx, 0}, od, true);
                 }
             }
         }
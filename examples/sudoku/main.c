@@ -4,50 +4,35 @@
 #include "wfc_heuristic_v2.h"
 #include <assert.h>
 #include <time.h>
-typedef enum { SameQuadrant, SameColumn, SameLine } SudokuRel;
 static Vector2 sudokuSize = {9, 9};
 
-int SudokuRelationship(WFC_State* wfc, int sCellIdx, int dCellIdx)
+// Each cell is in a line, a column and a quadrant
+int SudokuHouses(int cellIdx, int* houses)
 {
-    int sCellY = sCellIdx / sudokuSize.x;
-    int sCellX = sCellIdx - sCellY * sudokuSize.x;
-
-    int dCellY = dCellIdx / sudokuSize.x;
-    int dCellX = dCellIdx - dCellY * sudokuSize.x;
-
-    if (sCellX / 3 == dCellX / 3 && sCellY / 3 == dCellY / 3)
-        return SameQuadrant;
-    else if (sCellX == dCellX)
-        return SameColumn;
-    else if (sCellY == dCellY)
-        return SameLine;
-    else
-        return -1;
+    int cellY = cellIdx / sudokuSize.x;
+    int cellX = cellIdx - cellY * sudokuSize.x;
+
+    houses[0] = cellY;
+    houses[1] = 9 + cellX;
+    houses[2] = 18 + (cellY / 3) * 3 + cellX / 3;
+    return 3;
 }
 
 // Hardest puzzle from https://sandiway.arizona.edu/sudoku/examples.html
 #define IDX(x, y) ((x) + (y) * 9)
 void InitialState(WFC_State* wfc)
 {
-    WFC_SetTileTo(wfc, IDX(1,0), 2 -1);
-    WFC_SetTileTo(wfc, IDX(3,1), 6 -1);
-    WFC_SetTileTo(wfc, IDX(8,1), 3 -1);
-    WFC_SetTileTo(wfc, IDX(1,2), 7 -1);
-    WFC_SetTileTo(wfc, IDX(2,2), 4 -1);
-    WFC_SetTileTo(wfc, IDX(4,2), 8 -1);
-    WFC_SetTileTo(wfc, IDX(5,3), 3 -1);
-    WFC_SetTileTo(wfc, IDX(8,3), 2 -1);
-    WFC_SetTileTo(wfc, IDX(1,4), 8 -1);
-    WFC_SetTileTo(wfc, IDX(4,4), 4 -1);
-    WFC_SetTileTo(wfc, IDX(7,4), 1 -1);
-    WFC_SetTileTo(wfc, IDX(0,5), 6 -1);
-    WFC_SetTileTo(wfc, IDX(3,5), 5 -1);
-    WFC_SetTileTo(wfc, IDX(4,6), 1 -1);
-    WFC_SetTileTo(wfc, IDX(6,6), 7 -1);
-    WFC_SetTileTo(wfc, IDX(7,6), 8 -1);
-    WFC_SetTileTo(wfc, IDX(0,7), 5 -1);
-    WFC_SetTileTo(wfc, IDX(5,7), 9 -1);
-    WFC_SetTileTo(wfc, IDX(7,8), 4 -1);
+    const int cells[] = {
+        IDX(1,0), IDX(3,1), IDX(8,1), IDX(1,2), IDX(2,2), IDX(4,2), IDX(5,3), IDX(8,3), IDX(1,4), IDX(4,4),
+        IDX(7,4), IDX(0,5), IDX(3,5), IDX(4,6), IDX(6,6), IDX(7,6), IDX(0,7), IDX(5,7), IDX(7,8),
+    };
+    const int numbers[] = {
+        2 -1, 6 -1, 3 -1, 7 -1, 4 -1, 8 -1, 3 -1, 2 -1, 8 -1, 4 -1,
+        1 -1, 6 -1, 5 -1, 1 -1, 7 -1, 8 -1, 5 -1, 9 -1, 4 -1,
+    };
+
+    // All the givens are propagated together
+    WFC_SetTilesTo(wfc, cells, numbers, sizeof cells / sizeof cells[0]);
 }
 
 void DrawSudoku(WFC_State* wfc, int x, int y, float scale);
@@ -71,7 +56,7 @@ int main(void)
     };
 
     WFC_State wfc = {0};
-    WFC_Init(&wfc, tileset, 9, 3);
+    WFC_Init(&wfc, tileset, 9, 1);
 
     if (!wfc.initialized)
     {
@@ -80,24 +65,25 @@ int main(void)
         return 1;
     }
 
-    for (int i = 0; i < 9 * 9; i++)
+    WFC_AddCells(&wfc, 9 * 9);
+
+    // Lines, columns and quadrants are groups whose numbers must all be different
+    for (int h = 0; h < 27; h++)
     {
-        WFC_AddCell(&wfc);
+        WFC_AddGroup(&wfc);
     }
 
-    // Set up relationships
-    for (int i = 0; i < wfc.tileCount; i++)
+    for (int i = 0; i < 9 * 9; i++)
     {
-        for (int j = 0; j < wfc.tileCount; j++)
-        {
-            // Allow equal numbers on the same quadrant, line or column only if they're different
-            WFC_SetRule(&wfc, tileset[i], tileset[j], SameQuadrant, i != j);
-            WFC_SetRule(&wfc, tileset[i], tileset[j], SameLine    , i != j);
-            WFC_SetRule(&wfc, tileset[i], tileset[j], SameColumn  , i != j);
-        }
+        int houses[3];
+        int houseCount = SudokuHouses(i, houses);
+        for (int h = 0; h < houseCount; h++)
+            WFC_AddToGroup(&wfc, houses[h], i);
     }
 
-    WFC_CalculateNeighbors(&wfc, SudokuRelationship);
+    const int numbers[9] = { 0, 1, 2, 3, 4, 5, 6, 7, 8 };
+    WFC_AddGroupRule(&wfc, WFC_GROUP_ALL_DIFFERENT, numbers, 9);
+
     InitialState(&wfc);
 
     TraceLog(LOG_INFO, "WFC initialized successfully!");
@@ -132,7 +118,21 @@ int main(void)
             }
             WFC_Run(&wfc);
 
-            TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d", wfc.totalIterations, wfc.totalObservations, wfc.totalPropagations, wfc.totalResets));
+            TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d | Backtracks: %d", wfc.totalIterations, wfc.totalObservations, wfc.totalPropagations, wfc.totalResets, wfc.totalBacktracks));
+            autostep = false;
+            timer = stepDelay;
+        }
+
+        // Race several seeds and keep the first solution
+        if (IsKeyPressed(KEY_P))
+        {
+            WFC_Reset(&wfc);
+
+            uint64_t seed = 0;
+            if (WFC_RunPortfolio(&wfc, GetRandomValue(0, 1 << 30), 32, 8, &seed) == WFC_SUCCESS)
+                TraceLog(LOG_INFO, TextFormat("Portfolio won by seed %llu.", (unsigned long long) seed));
+
+            TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d | Backtracks: %d", wfc.totalIterations, wfc.totalObservations, wfc.totalPropagations, wfc.totalResets, wfc.totalBacktracks));
             autostep = false;
             timer = stepDelay;
         }
@@ -143,7 +143,7 @@ int main(void)
 
             if (wfc.isFinished)
             {
-                TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d", wfc.totalIterations, wfc.totalObservations, wfc.totalPropagations, wfc.totalResets));
+                TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d | Backtracks: %d", wfc.totalIterations, wfc.totalObservations, wfc.totalPropagations, wfc.totalResets, wfc.totalBacktracks));
             }
             autostep = false;
             timer = stepDelay;
@@ -158,7 +158,7 @@ int main(void)
 
                 if (wfc.isFinished)
                 {
-                    TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d", wfc.totalIterations, wfc.totalObservations, wfc.totalPropagations, wfc.totalResets));
+                    TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d | Backtracks: %d", wfc.totalIterations, wfc.totalObservations, wfc.totalPropagations, wfc.totalResets, wfc.totalBacktracks));
                     autostep = false;
                     timer = stepDelay;
                 }
@@ -210,7 +210,7 @@ void DrawSudoku(WFC_State* wfc, int x, int y, float scale)
         int ty = i / sudokuSize.x;
         int tx = i - ty * sudokuSize.x;
 
-        WFC_Cell* cell = &wfc->wave[i];
+        WFC_Cell cell = WFC_GetCell(wfc, i);
         Rectangle drawBounds = {
             x + tx * tileSize.x * scale + (tx / 3) * 1.5,
             y + ty * tileSize.y * scale + (ty / 3) * 1.5,
@@ -219,34 +219,34 @@ void DrawSudoku(WFC_State* wfc, int x, int y, float scale)
 
         Color drawCol = BLACK;
 
-        if (cell->isCollapsed)
-            drawCol = tileCols[cell->collapsedTile];
+        if (cell.isCollapsed)
+            drawCol = tileCols[cell.collapsedTile];
         else
         {
             // Spaces with less number obtions are brighter.
-            drawCol.r = 255 * (wfc->tileCount - (float) cell->validTileCount / wfc->tileCount);
-            drawCol.g = 255 * (wfc->tileCount - (float) cell->validTileCount / wfc->tileCount);
-            drawCol.b = 255 * (wfc->tileCount - (float) cell->validTileCount / wfc->tileCount);
+            drawCol.r = 255 * (wfc->tileCount - (float) cell.validTileCount / wfc->tileCount);
+            drawCol.g = 255 * (wfc->tileCount - (float) cell.validTileCount / wfc->tileCount);
+            drawCol.b = 255 * (wfc->tileCount - (float) cell.validTileCount / wfc->tileCount);
 
             /* int r = 0, g = 0, b = 0; */
             /* for (int t = 0; t < wfc->tileCount; t++) */
             /* { */
-            /*     if (cell->validTiles[t] == false) continue; */
+            /*     if (!WFC_IsTileValid(wfc, i, t)) continue; */
             /*     Tile* tile = &wfc->tileset[t]; */
             /*     r += tileCols[tile->val].r; */
             /*     g += tileCols[tile->val].g; */
             /*     b += tileCols[tile->val].b; */
             /* } */
 
-            /* drawCol.r = r / cell->validTileCount; */
-            /* drawCol.g = g / cell->validTileCount; */
-            /* drawCol.b = b / cell->validTileCount; */
+            /* drawCol.r = r / cell.validTileCount; */
+            /* drawCol.g = g / cell.validTileCount; */
+            /* drawCol.b = b / cell.validTileCount; */
         }
 
         DrawRectangleRec(drawBounds, drawCol);
-        if (cell->isCollapsed)
+        if (cell.isCollapsed)
         {
-            DrawText(TextFormat("%d", cell->collapsedTile), drawBounds.x + 5, drawBounds.y + 5, 10*scale, BLACK);
+            DrawText(TextFormat("%d", cell.collapsedTile), drawBounds.x + 5, drawBounds.y + 5, 10*scale, BLACK);
         }
 
         DrawRectangleLinesEx(drawBounds, 2, BLACK);
@@ -256,7 +256,7 @@ void DrawSudoku(WFC_State* wfc, int x, int y, float scale)
             DrawRectangleLinesEx(drawBounds, 5, WHITE);
             DrawText(
                 TextFormat("Cell %d (%d, %d): valid_tiles: %d",
-                           cell->idx, tx, ty, cell->validTileCount),
+                           cell.idx, tx, ty, cell.validTileCount),
                 x, y + 420, 20, BLACK);
         }
     }
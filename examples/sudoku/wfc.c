@@ -1,3 +1,4 @@
 #define WFC_METRICS
+#define WFC_THREADS
 #define WFC_IMPLEMENTATION
 #include "wfc_heuristic_v2.h"
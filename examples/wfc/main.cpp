@@ -100,7 +100,7 @@ int main(void)
             }
             WFC_Run(&td.wfc);
 
-            TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d", td.wfc.totalIterations, td.wfc.totalObservations, td.wfc.totalPropagations, td.wfc.totalResets));
+            TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d | Backtracks: %d", td.wfc.totalIterations, td.wfc.totalObservations, td.wfc.totalPropagations, td.wfc.totalResets, td.wfc.totalBacktracks));
             autostep = false;
             timer = stepDelay;
         }
@@ -111,7 +111,7 @@ int main(void)
 
             if (td.wfc.isFinished)
             {
-                TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d", td.wfc.totalIterations, td.wfc.totalObservations, td.wfc.totalPropagations, td.wfc.totalResets));
+                TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d | Backtracks: %d", td.wfc.totalIterations, td.wfc.totalObservations, td.wfc.totalPropagations, td.wfc.totalResets, td.wfc.totalBacktracks));
             }
             autostep = false;
             timer = stepDelay;
@@ -126,7 +126,7 @@ int main(void)
 
                 if (td.wfc.isFinished)
                 {
-                    TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d", td.wfc.totalIterations, td.wfc.totalObservations, td.wfc.totalPropagations, td.wfc.totalResets));
+                    TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d | Backtracks: %d", td.wfc.totalIterations, td.wfc.totalObservations, td.wfc.totalPropagations, td.wfc.totalResets, td.wfc.totalBacktracks));
                     autostep = false;
                     timer = stepDelay;
                 }
@@ -357,20 +357,15 @@ int TilesetDisplay::LoadFromXML(const char* tilesetsPath, std::pair<const char*,
         return 1;
     }
 
-    // Create cells and set their neighbors.
-    // Since neighbors are indices, we can set them before they're actually
-    // added to the WFC. Not really safe, but meh.
-    for (int i = 0; i < outputX * outputY; i++)
+    // A rule for one direction is also the mirrored rule for the opposite one
+    WFC_SetInverse(&this->wfc, RIGHT, LEFT);
+    WFC_SetInverse(&this->wfc, UP, DOWN);
+
+    // Create the cells as a grid, whose neighbors are computed instead of stored
+    WFC_Grid grid = { outputX, outputY, 1, { false, false, false }, { LEFT, RIGHT, UP, DOWN, -1, -1 } };
+    if (WFC_SetGrid(&this->wfc, &grid))
     {
-        int idx = WFC_AddCell(&this->wfc);
-        if (idx % outputX > 0)
-            WFC_AddNeighbor(&wfc, idx, idx-1, LEFT);
-        if (idx % outputX < outputX-1)
-            WFC_AddNeighbor(&wfc, idx, idx+1, RIGHT);
-        if (idx / outputX > 0)
-            WFC_AddNeighbor(&wfc, idx, idx-outputX, UP);
-        if (idx / outputX < outputY-1)
-            WFC_AddNeighbor(&wfc, idx, idx+outputX, DOWN);
+        return 1;
     }
 
     for (tinyxml2::XMLElement* elem = tilesetDocRoot->FirstChildElement("neighbors")->FirstChildElement("neighbor"); elem != nullptr; elem = elem->NextSiblingElement("neighbor"))
@@ -389,21 +384,11 @@ int TilesetDisplay::LoadFromXML(const char* tilesetsPath, std::pair<const char*,
         WFC_SetRule(&this->wfc, tileArray[rot(rot(l))], tileArray[rot(rot(r))], LEFT, true);
         WFC_SetRule(&this->wfc, tileArray[rot(rot(rot(l)))], tileArray[rot(rot(rot(r)))], DOWN, true);
 
-        WFC_SetRule(&this->wfc, tileArray[r], tileArray[l], LEFT, true);
-        WFC_SetRule(&this->wfc, tileArray[rot(r)], tileArray[rot(l)], DOWN, true);
-        WFC_SetRule(&this->wfc, tileArray[rot(rot(r))], tileArray[rot(rot(l))], RIGHT, true);
-        WFC_SetRule(&this->wfc, tileArray[rot(rot(rot(r)))], tileArray[rot(rot(rot(l)))], UP, true);
-
         WFC_SetRule(&this->wfc, tileArray[mirX(r)], tileArray[mirX(l)], RIGHT, true);
         WFC_SetRule(&this->wfc, tileArray[rot(mirX(r))], tileArray[rot(mirX(l))], UP, true);
         WFC_SetRule(&this->wfc, tileArray[rot(rot(mirX(r)))], tileArray[rot(rot(mirX(l)))], LEFT, true);
         WFC_SetRule(&this->wfc, tileArray[rot(rot(rot(mirX(r))))], tileArray[rot(rot(rot(mirX(l))))], DOWN, true);
 
-        WFC_SetRule(&this->wfc, tileArray[mirX(l)], tileArray[mirX(r)], LEFT, true);
-        WFC_SetRule(&this->wfc, tileArray[rot(mirX(l))], tileArray[rot(mirX(r))], DOWN, true);
-        WFC_SetRule(&this->wfc, tileArray[rot(rot(mirX(l)))], tileArray[rot(rot(mirX(r)))], RIGHT, true);
-        WFC_SetRule(&this->wfc, tileArray[rot(rot(rot(mirX(l))))], tileArray[rot(rot(rot(mirX(r))))], UP, true);
-
         // int l = leftId, r = rightId;
         // for (int i = 0; i < 4; i++)
         // {
@@ -455,7 +440,7 @@ void TilesetDisplay::DrawWFC(float x, float y, float scale)
 
     for (int i = 0; i < outputX * outputY; i++)
     {
-        WFC_Cell& cell = wfc.wave[i];
+        WFC_Cell cell = WFC_GetCell(&wfc, i);
         int my = i / outputX;
         int mx = i - my * outputX;
         Color col = WHITE;
@@ -465,7 +450,7 @@ void TilesetDisplay::DrawWFC(float x, float y, float scale)
 
         for (int t = 0; t < wfc.tileCount; t++)
         {
-            if (!cell.validTiles[t])
+            if (!WFC_IsTileValid(&wfc, i, t))
                 continue;
 
             auto tileTexInfo = tileTexs.find(t)->second;
@@ -481,7 +466,7 @@ void TilesetDisplay::DrawWFC(float x, float y, float scale)
 
         if (CheckCollisionPointRec(GetMousePosition(), drawBounds))
         {
-            DrawText(TextFormat("Tile %d: %d neighbors, %d valid tiles", cell.idx, cell.neighborCount, cell.validTileCount),
+            DrawText(TextFormat("Tile %d: %d neighbors, %d valid tiles", cell.idx, WFC_NeighborCount(&wfc, cell.idx), cell.validTileCount),
                      200, 420, 10, BLACK);
         }
     }
@@ -316,24 +316,18 @@ WFCTexture::WFCTexture (int width, int height, int sample, int patternSize, bool
     };
 
     WFC_Init(&wfc, &tiles[0], tiles.size(), 4);
+    WFC_SetEngine(&wfc, WFC_ENGINE_AC4); // Overlap models have many patterns, so count supports instead
+    WFC_SetInverse(&wfc, LEFT, RIGHT);
+    WFC_SetInverse(&wfc, DOWN, UP);
     wfc.maxResets = WFC_MAX_RESETS;
 
     // Add cells in the grid
-    for (int i = 0; i < width * height; i++)
-    {
-        WFC_AddCell(&wfc);
-        if ((i / width) > 0)
-            WFC_AddNeighbor(&wfc, i, i-width, UP);
-        if ((i / width) < height-1)
-            WFC_AddNeighbor(&wfc, i, i+width, DOWN);
-        if ((i % width) > 0)
-            WFC_AddNeighbor(&wfc, i, i-1, LEFT);
-        if ((i % width) < width-1)
-            WFC_AddNeighbor(&wfc, i, i+1, RIGHT);
-    }
+    WFC_Grid grid = { width, height, 1, { false, false, false }, { LEFT, RIGHT, UP, DOWN, -1, -1 } };
+    WFC_SetGrid(&wfc, &grid);
 
     // Generate rules between patterns based on their overlap.
-    for (int d = 0; d < 4; d++)
+    // Overlaps are symmetric, so the rules of RIGHT and UP are the inverses of LEFT and DOWN.
+    for (int d = LEFT; d <= DOWN; d++)
     {
         for (int t1 = 0; t1 < tiles.size(); t1++)
         {
@@ -363,7 +357,7 @@ void WFCTexture::Generate()
 
     if (wfc.isFinished)
     {
-        TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d", wfc.totalIterations, wfc.totalObservations, wfc.totalPropagations, wfc.totalResets));
+        TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d | Backtracks: %d", wfc.totalIterations, wfc.totalObservations, wfc.totalPropagations, wfc.totalResets, wfc.totalBacktracks));
     }
     dirty = true;
 }
@@ -384,7 +378,7 @@ void WFCTexture::GenStep()
 
     if (wfc.isFinished)
     {
-        TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d", wfc.totalIterations, wfc.totalObservations, wfc.totalPropagations, wfc.totalResets));
+        TraceLog(LOG_INFO, TextFormat("WFC finished with %d iterations. Observations: %d | Propagations: %d | Resets: %d | Backtracks: %d", wfc.totalIterations, wfc.totalObservations, wfc.totalPropagations, wfc.totalResets, wfc.totalBacktracks));
     }
     dirty = true;
 }
@@ -406,7 +400,7 @@ void WFCTexture::Update()
     {
         int y = i / outW;
         int x = i - y * outW;
-        WFC_Cell& cell = wfc.wave[i];
+        WFC_Cell cell = WFC_GetCell(&wfc, i);
 
         if (cell.isCollapsed)
         {
@@ -433,7 +427,7 @@ void WFCTexture::Update()
 
             for (int t = 0; t < tiles.size(); t++)
             {
-                if (wfc.wave[adj].validTiles[t] != true) continue;
+                if (!WFC_IsTileValid(&wfc, adj, t)) continue;
 
                 contributors++;
                 r += palette[patterns[t][dx + dy * patternSize]].r;
@@ -490,7 +484,7 @@ void WFCTexture::Draw(float x, float y, float scale)
         int hoverX = (mousePos.x - x) / scale;
         int hoverY = (mousePos.y - y) / scale;
         int hoverCellIdx = hoverX + hoverY * currentOutTex.width;
-        DrawText(TextFormat("Cell %d - Neighbors: %d - Tiles: %d (%s)", hoverCellIdx, wfc.wave[hoverCellIdx].neighborCount, wfc.wave[hoverCellIdx].validTileCount, wfc.wave[hoverCellIdx].isCollapsed ? "Collapsed" : "Not Collapsed"), 200, 10, 20, BLACK);
+        DrawText(TextFormat("Cell %d - Neighbors: %d - Tiles: %d (%s)", hoverCellIdx, WFC_NeighborCount(&wfc, hoverCellIdx), WFC_GetCell(&wfc, hoverCellIdx).validTileCount, WFC_GetCell(&wfc, hoverCellIdx).isCollapsed ? "Collapsed" : "Not Collapsed"), 200, 10, 20, BLACK);
     }
 }
 
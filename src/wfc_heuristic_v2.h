@@ -34,6 +34,25 @@
 
 /* #define WFC_MAX_RESETS 1000 */
 
+// Define WFC_THREADS to use POSIX threads in the implementation: WFC_RunBatch spreads runs over workers,
+// WFC_RunPortfolio races seeds and WFC_CalculateNeighborsBucketed checks candidate pairs in parallel.
+/* #define WFC_THREADS */
+
+// Alignment of the domain slab, in bytes
+#ifndef WFC_DOMAIN_ALIGN
+#define WFC_DOMAIN_ALIGN 64
+#endif
+
+// Backtracks allowed before giving up on the current wave and resetting it. 0 means no limit.
+#ifndef WFC_BACKTRACK_LIMIT
+#define WFC_BACKTRACK_LIMIT 10000
+#endif
+
+// Propagation engine used by states unless changed with WFC_SetEngine
+#ifndef WFC_DEFAULT_ENGINE
+#define WFC_DEFAULT_ENGINE WFC_ENGINE_PAIRWISE
+#endif
+
 // Metrics and reset limit
 #ifdef WFC_DEBUG
 #include <stdio.h>
@@ -45,6 +64,8 @@
 #endif
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /*********************/
 /* Tiles and Tileset */
@@ -59,37 +80,185 @@ typedef struct {
 /* WFC Stuff */
 /*************/
 
-// Represents an individual cell in the wave
+// Solver state of a cell. Kept apart from the rest of the cell, so that scans only touch these bytes.
+typedef struct
+{
+    // Caching
+    WFC_WEIGHTS_TYPE weightLogWeightSum;
+    // TODO: maybe I should use int sumWeights instead?
+    float sumWeights;
+    int validTileCount;
+    int collapsedTile;
+    bool isCollapsed;
+} WFC_CellState;
+
+// A copy of an individual cell in the wave, returned by WFC_GetCell
 typedef struct WFC_Cell
 {
     int idx;
     bool isCollapsed;
     int collapsedTile;
 
-    // TODO: maybe I should use int sumWeights instead?
     float sumWeights;
     int validTileCount;
-    bool* validTiles;
     int initialTile; // This is set by WFC_SetTileTo
 
-    // Caching
     WFC_WEIGHTS_TYPE weightLogWeightSum;
-
-    int neighborCount;
-    int _neighborCap; // Used during generation.
-    // FIXME: não dá pra usar esse rel pq os índices nesse vetor não batem, precisaria ser um hashmap...
-    struct { int idx; int rel; }* neighbors; // NOTE: it's important to use this indexes here to avoid reallocation problems
 } WFC_Cell;
 
-// TODO: adicionar relação aqui, aí dá pra usar o rel pré-calculada
+// An edge between two cells
 typedef struct
 {
     int from;
     int to;
     int rel;
-} WFC_Prop;
+    bool undirected; // Also an edge from "to" back to "from", with the inverse relationship
+} WFC_Edge;
+
+// Directions of a grid, in the order used by WFC_Grid::rels
+typedef enum
+{
+    WFC_DIR_NEG_X = 0,
+    WFC_DIR_POS_X,
+    WFC_DIR_NEG_Y,
+    WFC_DIR_POS_Y,
+    WFC_DIR_NEG_Z,
+    WFC_DIR_POS_Z,
+} WFC_Direction;
+
+// A regular 2D or 3D grid, whose neighbors are computed from the cell index instead of stored.
+// Cell (x, y, z) has index x + y * width + z * width * height.
+typedef struct
+{
+    int width;
+    int height;
+    int depth; // 1 for a 2D grid
+    bool periodic[3]; // Whether the x, y and z axes wrap around
+    int rels[6]; // Relationship towards each WFC_Direction, -1 for none. Z directions are ignored in 2D.
+} WFC_Grid;
+
+// A tile removed from a cell whose supports haven't been withdrawn yet (AC-4 engine)
+typedef struct
+{
+    int cell;
+    int tile;
+} WFC_Ban;
+
+// An observation, undone when backtracking
+typedef struct
+{
+    int cell;
+    int tile;
+    int trailStart; // Trail length before the observation
+} WFC_Decision;
+
+// The state of a cell before its first change in a decision level
+typedef struct
+{
+    int cell;
+    int prevLevel; // Level at which the cell had last been saved
+    WFC_CellState state;
+} WFC_TrailEntry;
 
-#define MAX_PROPS 256
+// Rules over the tiles placed in each group of cells
+typedef enum
+{
+    // At most one tile of the set in each group. That tile can still repeat within the group.
+    WFC_GROUP_EXCLUSIVE = 0,
+    // Each tile of the set in at most one group
+    WFC_GROUP_SINGLE,
+    // No two cells of a group share a tile of the set. Cells that can only take tiles of the set are
+    // matched to distinct tiles, so naked and hidden subsets are found, not only collapsed cells.
+    WFC_GROUP_ALL_DIFFERENT,
+} WFC_GroupRule;
+
+// A cell's membership in a group
+typedef struct
+{
+    int cell;
+    int group;
+} WFC_GroupMember;
+
+// A tile placed in a group for the first time, whose group rules haven't been applied yet
+typedef struct
+{
+    int group;
+    int tile;
+} WFC_GroupEvent;
+
+// Keeps every cell that takes a passable tile connected to a seed cell, through cells that also take passable tiles
+typedef struct
+{
+    int seed; // -1 to only keep the passable cells connected to each other
+    uint32_t relMask; // Relations that connect cells, bit r for relation r
+} WFC_Connectivity;
+
+// Bounds on how many cells of a group, or of the whole wave, take a tile
+typedef struct
+{
+    int group; // -1 for the whole wave
+    int tile;
+    int min;
+    int max;
+} WFC_TileLimit;
+
+// Order in which cells with changed domains get their neighbors revised
+typedef enum
+{
+    WFC_PROP_LIFO = 0,
+    WFC_PROP_FIFO,
+} WFC_PropOrder;
+
+typedef enum
+{
+    // Revises each edge by checking the whole source domain against the destination.
+    WFC_ENGINE_PAIRWISE = 0,
+    // Keeps per-edge support counts (AC-4), so a ban only touches the tiles it supported.
+    // Costs edge count * tile count ints of memory.
+    WFC_ENGINE_AC4,
+} WFC_Engine;
+
+// How the engines read a relationship, picked from its density by WFC_CompileRules
+typedef enum
+{
+    // Union of the packed rows of the source's tiles
+    WFC_REL_DENSE = 0,
+    // Few pairs are allowed: union of the compatible tile lists of the source's tiles
+    WFC_REL_SPARSE,
+    // Few pairs are forbidden: a destination tile is only removed if every tile at the source bans it
+    WFC_REL_COMPLEMENT,
+    // Every pair is allowed: the relationship never prunes, so its edges are skipped by both engines
+    WFC_REL_TRIVIAL,
+} WFC_RelKind;
+
+// Tiles and the rules between them. Once compiled, a ruleset is read-only and can be shared
+// by any number of states, including states running on other threads.
+typedef struct WFC_Rules
+{
+    bool initialized;
+    bool compiled; // Cleared whenever a rule changes
+
+    int tileCount;
+    Tile* tileset;
+    int relCount; // Count of relationships
+    int tileWords; // Count of 64-bit words in a tile bitset
+    int* inverse; // Inverse of each relationship, set by WFC_DefineInverse. -1 if none. Length = relCount
+
+    // Packed rows of allowed destination tiles, one row per (relationship, source tile).
+    // Length = Relationship count * Tile Count * tileWords
+    uint64_t* propagator;
+
+    // Compiled tables, used by the AC-4 engine
+    int* compatOffsets; // Length = relCount * tileCount + 1. Ranges into compat.
+    int* compat; // Destination tiles allowed by each (relationship, source tile).
+    int* fullSupports; // Length = relCount * tileCount. Supports of each tile from a full domain.
+
+    // Compiled tables, used by the pairwise engine
+    WFC_RelKind* relKinds; // Length = relCount
+    int* bannedOffsets; // Length = relCount * tileCount + 1. Ranges into banned.
+    int* banned; // Source tiles that forbid each (relationship, destination tile). Only filled for complement relationships.
+    int* maxBanned; // Length = relCount. Longest banned list of each complement relationship.
+} WFC_Rules;
 
 // Represents the state of the WFC at the current step.
 typedef struct WFC_State
@@ -98,20 +267,151 @@ typedef struct WFC_State
     bool isFinished;
     bool _dirty;
 
-    int tileCount;
-    Tile* tileset;
+    WFC_Engine engine;
 
-    int relCount; // Count of relationships
+    const WFC_Rules* rules;
+    WFC_Rules* _ownedRules; // Set if the rules were created by WFC_Init, NULL if shared
 
-    bool* propagator; // Length = Relationship count * Tile Count * Tile Count
-    // Queued up propagations
-    WFC_Prop props[MAX_PROPS];
+    // Copied from the rules
+    int tileCount;
+    Tile* tileset;
+    int relCount;
+    int tileWords;
+
+    uint64_t* _rowScratch; // Length = tileWords. Used during propagation.
+    // Queued up propagations: cells whose neighbors must be revised.
+    // Each cell is in the queue at most once, so it never needs more than cellCount slots.
+    WFC_PropOrder propOrder;
+    int* _propQueue; // Ring buffer. Length = _propCap
+    bool* _inPropQueue; // Length = _propCap
+    int _propHead;
     int propCount;
+    int _propCap;
+
+    // Neighbors in compressed sparse row form, rebuilt by WFC__RefitState. The outgoing edges of cell c
+    // are _adjOffsets[c] <= e < _adjOffsets[c + 1], going to _adjIdx[e] with relationship _adjRel[e].
+    int* _adjOffsets; // Length = _adjCells + 1
+    int* _adjIdx; // Length = edgeCount
+    int* _adjRel; // Length = edgeCount
+    int edgeCount;
+    int _adjCells; // Cells in the rows. Cells added since the last refit have no edges yet.
+    WFC_Edge* _newEdges; // Edges added since the last refit, merged into the rows on the next one
+    int _newEdgeCount;
+    int _newEdgeCap;
+
+    // Parallel edges are merged into one edge with a composite relationship, numbered from relCount.
+    // A composite allows what all of its parts allow.
+    int* _compositeOffsets; // Length = _compositeCount + 1. Ranges into _compositeParts.
+    int* _compositeParts; // Sorted relationships of each composite
+    int _compositeCount;
+    int _compositePartCap;
+    WFC_Rules _composites; // Rows of the composites, rebuilt by WFC__RefitState
+
+    // Implicit grid neighbors, set by WFC_SetGrid. The first _gridCells cells have one edge per direction,
+    // numbered cell * _gridDirs + direction, before the edges in the rows.
+    WFC_Grid _grid;
+    int _gridCells; // 0 if there's no grid
+    int _gridDirs; // 4 in 2D, 6 in 3D
+
+    // AC-4 engine data. Only allocated when engine == WFC_ENGINE_AC4.
+    int* _supports; // Length = (grid edges + edgeCount) * tileCount. Source tiles still supporting each destination tile.
+    WFC_Ban* _bans; // Stack of bans waiting to be propagated.
+    int _banCount;
+    int _banCap;
+
+    // Groups of cells, with rules over the tiles placed in each group instead of edges between every member.
+    // Memberships are kept as added, and sorted into rows by group and by cell in WFC__RefitState.
+    int groupCount;
+    WFC_GroupMember* _members;
+    int _memberCount;
+    int _memberCap;
+    int* _groupOffsets; // Length = groupCount + 1. Ranges into _groupCells.
+    int* _groupCells; // Length = _memberCount
+    int* _cellGroupOffsets; // Length = _groupRowCells + 1. Ranges into _cellGroups.
+    int* _cellGroups; // Length = _memberCount
+    int _groupRowCells; // Cells in the rows, 0 if they aren't built
+    WFC_GroupRule* _groupRules;
+    uint64_t* _groupRuleTiles; // Tiles of each rule. Length = _groupRuleCount * tileWords
+    int _groupRuleCount;
+    int* _groupTileCounts; // Collapsed cells of each tile in each group. Length = groupCount * tileCount
+    WFC_GroupEvent* _groupEvents; // Stack. Each (group, tile) is in it at most once, so Length = groupCount * tileCount
+    int _groupEventCount;
+    // Groups whose cells changed since their AllDifferent rules were last checked. Only allocated if there's such a rule.
+    int* _groupQueue; // Stack. Length = groupCount
+    bool* _inGroupQueue; // Length = groupCount
+    int _groupQueueCount;
+    int* _matchScratch; // Used by the AllDifferent filter. Length = 7 * (largest group + tileCount)
+
+    // Tile limits. Their counters are kept up to date as domains shrink and are rebuilt by WFC__RefitState.
+    WFC_TileLimit* _limits;
+    int _limitCount;
+    int* _limitOffsets; // Length = tileCount + 1. Ranges into _limitsByTile.
+    int* _limitsByTile; // Length = _limitCount
+    int* _limitPlaced; // Cells collapsed to the tile. Length = _limitCount
+    int* _limitCandidates; // Cells where the tile is still valid. Length = _limitCount
+    int* _limitQueue; // Stack of limits that reached a bound. Length = _limitCount
+    bool* _inLimitQueue; // Length = _limitCount
+    int _limitQueueCount;
+
+    // Connectivity rules. Each cell can't, may or must take a passable tile of each rule, tracked as domains change.
+    WFC_Connectivity* _conns;
+    uint64_t* _connTiles; // Passable tiles of each rule. Length = _connCount * tileWords
+    int _connCount;
+    uint8_t* _connStates; // Length = _connCount * _connCells
+    int _connCells; // Cells when the rows below were built
+    int* _connAdjOffsets; // Length = _connCells + 1. Ranges into _connAdj and _connAdjRel.
+    int* _connAdj; // Explicit edges in both directions
+    int* _connAdjRel;
+    int* _connScratch; // Used by the cut search. Length = 5 * _connCells
+    int* _connQueue; // Stack of rules whose states changed. Length = _connCount
+    bool* _inConnQueue; // Length = _connCount
+    int _connQueueCount;
 
     /* int outputW, outputH; */
     int cellCount;
     int _cellCap;
-    WFC_Cell* wave; 
+    // The wave, as parallel arrays indexed by cell. Use WFC_GetCell to read a cell.
+    WFC_CellState* _cells; // Length = _cellCap
+    double* _entropy; // Entropy plus noise. Key of the observation heap. Length = _cellCap
+    double* _noise; // Tie-breaking noise, drawn when the cell is created, seeded or reset. Length = _cellCap
+    int* _initialTile; // Set by WFC_SetTileTo, -1 if none. Length = _cellCap
+    uint64_t* _initialMasks; // Tiles each cell starts with, set by WFC_RestrictCells. NULL if none. Length = _cellCap * tileWords
+    // Valid tiles of every cell, tileWords words each, in cell order. Use WFC_IsTileValid to query.
+    uint64_t* _domains; // Length = _cellCap * tileWords. Aligned to WFC_DOMAIN_ALIGN.
+    void* _domainsBlock; // Allocation holding _domains
+    // Sums of a full domain, set at init and reset
+    float _fullSumWeights;
+    WFC_WEIGHTS_TYPE _fullWeightLogWeightSum;
+
+    // The wave right after the initial tiles were propagated, restored by later resets.
+    // Invalidated by any change to the cells, edges, rules, engine or initial tiles.
+    bool _snapshotValid;
+    uint64_t* _snapDomains; // Length = cellCount * tileWords
+    WFC_CellState* _snapCells; // Length = cellCount
+    int* _snapSupports; // Same length as _supports. AC-4 engine only.
+
+    // Indexed min-heap of the uncollapsed cells, ordered by entropy
+    int* _heap; // Cell indices. Length = _heapCap
+    int* _heapPos; // Position of each cell in the heap, -1 if not in it. Length = _heapCap
+    int _heapCount;
+    int _heapCap;
+
+    // Backtracking. After the first decision, every cell is saved to the trail
+    // before its first change in each decision level.
+    WFC_Decision* _decisions;
+    int _decisionCount;
+    int _decisionCap;
+    WFC_TrailEntry* _trail;
+    uint64_t* _trailTiles; // Saved domains. Length = _trailCap * tileWords
+    int _trailCount;
+    int _trailCap;
+    bool _trailFailed; // Set if the trail couldn't grow, in which case the wave is reset instead
+    int* _savedLevel; // Last level each cell was saved at. Length = _heapCap
+    int backtrackLimit; // Backtracks before resetting the wave. 0 means no limit.
+    int _backtracks; // Backtracks since the last reset
+
+    uint64_t _rng[4]; // xoshiro256** state. Set with WFC_Seed.
+    void* _cancel; // Flag shared by the runs of a portfolio (an atomic_int), NULL otherwise
 
 #ifdef WFC_METRICS
     long maxResets;
@@ -119,35 +419,163 @@ typedef struct WFC_State
     long totalPropagations;
     long totalObservations;
     long totalResets;
+    long totalBacktracks;
 #endif
 } WFC_State;
 
 // TODO: rethink this entire function pointer business. maybe improve the interface?
 typedef int (*RelationshipFunction)(struct WFC_State*, int, int);
+// Writes the bucket keys of a cell into the array and returns how many it wrote.
+// Only cells that share a bucket are checked for a relationship.
+typedef int (*BucketFunction)(struct WFC_State*, int, int*);
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+    void WFC_InitRules(WFC_Rules* rules, Tile* tileset, int tileCount, int relCount);
+    void WFC_DefineRule(WFC_Rules* rules, Tile sTile, Tile dTile, int rel, bool allowed);
+    void WFC_DefineInverse(WFC_Rules* rules, int rel, int inverse);
+    int WFC_CompileRules(WFC_Rules* rules);
+    void WFC_CleanUpRules(WFC_Rules* rules);
+
     void WFC_Init(WFC_State* wfc, Tile* tileset, int tileCount, int relCount);
+    void WFC_InitShared(WFC_State* wfc, const WFC_Rules* rules);
+    void WFC_SetEngine(WFC_State* wfc, WFC_Engine engine);
+    void WFC_SetPropagationOrder(WFC_State* wfc, WFC_PropOrder order);
+    void WFC_Seed(WFC_State* wfc, uint64_t seed);
     void WFC_Reset(WFC_State* wfc);
     void WFC_CleanUp(WFC_State* wfc);
 
+    int WFC_ReserveCells(WFC_State* wfc, int cellCap);
     int WFC_AddCell(WFC_State* wfc);
+    int WFC_AddCells(WFC_State* wfc, int count);
     int WFC_RemoveCell(WFC_State* wfc, int idx);
     int WFC_AddNeighbor(WFC_State* wfc, int idxCell, int idxNeighbor, int rel);
+    int WFC_ReserveEdges(WFC_State* wfc, int edgeCap);
+    int WFC_AddEdges(WFC_State* wfc, const int* from, const int* to, const int* rels, int count);
     int WFC_RemoveNeighbor(WFC_State* wfc, int idxCell, int idxNeighbor);
     int WFC_CalculateNeighbors(WFC_State* wfc, RelationshipFunction relFunc);
+    int WFC_CalculateNeighborsBucketed(WFC_State* wfc, RelationshipFunction relFunc, BucketFunction bucketFunc, int maxKeys, int threadCount);
+    int WFC_SetGrid(WFC_State* wfc, const WFC_Grid* grid);
+    int WFC_AddGroup(WFC_State* wfc);
+    int WFC_AddToGroup(WFC_State* wfc, int groupIdx, int cellIdx);
+    int WFC_AddGroupRule(WFC_State* wfc, WFC_GroupRule rule, const int* tiles, int count);
+    int WFC_AddTileLimit(WFC_State* wfc, int groupIdx, int tile, int min, int max);
+    int WFC_AddConnectivity(WFC_State* wfc, const int* tiles, int count, int seedCell, uint32_t relMask);
     void WFC_SetRule(WFC_State* wfc, Tile sTile, Tile dTile, int rel, bool allowed);
+    void WFC_SetInverse(WFC_State* wfc, int rel, int inverse);
 
     void WFC_SetTileTo(WFC_State* wfc, int cellIdx, int tile);
+    int WFC_SetTilesTo(WFC_State* wfc, const int* cells, const int* tiles, int count);
+    int WFC_RestrictCells(WFC_State* wfc, const int* cells, int count, const uint64_t* masks, bool perCell);
     int WFC_DoStep(WFC_State* wfc);
     int WFC_Run(WFC_State* wfc);
 
+    int WFC_Clone(WFC_State* dst, const WFC_State* src);
+    int WFC_RunBatch(WFC_State* model, uint64_t firstSeed, int runCount, int* outTiles, int threadCount);
+    int WFC_RunPortfolio(WFC_State* wfc, uint64_t firstSeed, int runCount, int threadCount, uint64_t* winningSeed);
+
 #ifdef __cplusplus
 }
 #endif
 
+// Returns whether a tile is still possible in a cell.
+static inline bool WFC_IsTileValid(const WFC_State* wfc, int cellIdx, int tile)
+{
+    return (wfc->_domains[(size_t) cellIdx * wfc->tileWords + (tile >> 6)] >> (tile & 63)) & 1;
+}
+
+static inline WFC_Cell WFC_GetCell(const WFC_State* wfc, int cellIdx)
+{
+    const WFC_CellState* state = &wfc->_cells[cellIdx];
+    WFC_Cell cell;
+    cell.idx = cellIdx;
+    cell.isCollapsed = state->isCollapsed;
+    cell.collapsedTile = state->collapsedTile;
+    cell.sumWeights = state->sumWeights;
+    cell.validTileCount = state->validTileCount;
+    cell.initialTile = wfc->_initialTile[cellIdx];
+    cell.weightLogWeightSum = state->weightLogWeightSum;
+    return cell;
+}
+
+// Fills "out" with the grid neighbor of a cell in each direction, -1 where there's none.
+// Returns the count of directions, 0 for cells outside the grid.
+static inline int WFC__GridNeighbors(const WFC_State* wfc, int cellIdx, int* out)
+{
+    if (cellIdx >= wfc->_gridCells)
+        return 0;
+
+    const WFC_Grid* grid = &wfc->_grid;
+    const int size[3] = { grid->width, grid->height, grid->depth };
+    const int stride[3] = { 1, grid->width, grid->width * grid->height };
+    const int pos[3] = { cellIdx % grid->width, (cellIdx / grid->width) % grid->height, cellIdx / stride[2] };
+
+    for (int d = 0; d < wfc->_gridDirs; d++)
+    {
+        int axis = d >> 1;
+        int p = pos[axis] + ((d & 1) ? 1 : -1);
+        out[d] = -1;
+
+        if (p < 0 || p >= size[axis])
+        {
+            // Wrapping onto the cell itself isn't a neighbor
+            if (!grid->periodic[axis] || size[axis] < 2)
+                continue;
+            p = (p + size[axis]) % size[axis];
+        }
+
+        if (grid->rels[d] >= 0)
+            out[d] = cellIdx + (p - pos[axis]) * stride[axis];
+    }
+
+    return wfc->_gridDirs;
+}
+
+// Neighbor queries. These see the edges as of the last refit, which every step and run does first.
+// Grid neighbors come first, in direction order. Parallel edges are listed once, with a composite relationship.
+static inline int WFC_NeighborCount(const WFC_State* wfc, int cellIdx)
+{
+    int gridNeighbors[6];
+    int count = cellIdx < wfc->_adjCells ? wfc->_adjOffsets[cellIdx + 1] - wfc->_adjOffsets[cellIdx] : 0;
+    for (int d = WFC__GridNeighbors(wfc, cellIdx, gridNeighbors) - 1; d >= 0; d--)
+        count += gridNeighbors[d] >= 0;
+    return count;
+}
+
+// Returns the n-th neighbor of a cell, and its relationship through "rel" if not NULL
+static inline int WFC__NeighborAt(const WFC_State* wfc, int cellIdx, int n, int* rel)
+{
+    int gridNeighbors[6];
+    int dirs = WFC__GridNeighbors(wfc, cellIdx, gridNeighbors);
+    for (int d = 0; d < dirs; d++)
+    {
+        if (gridNeighbors[d] >= 0 && n-- == 0)
+        {
+            if (rel != NULL)
+                *rel = wfc->_grid.rels[d];
+            return gridNeighbors[d];
+        }
+    }
+
+    if (rel != NULL)
+        *rel = wfc->_adjRel[wfc->_adjOffsets[cellIdx] + n];
+    return wfc->_adjIdx[wfc->_adjOffsets[cellIdx] + n];
+}
+
+static inline int WFC_GetNeighbor(const WFC_State* wfc, int cellIdx, int n)
+{
+    return WFC__NeighborAt(wfc, cellIdx, n, NULL);
+}
+
+static inline int WFC_GetNeighborRel(const WFC_State* wfc, int cellIdx, int n)
+{
+    int rel;
+    WFC__NeighborAt(wfc, cellIdx, n, &rel);
+    return rel;
+}
+
 /* #define WFC_IMPLEMENTATION */
 #ifdef WFC_IMPLEMENTATION
 
@@ -158,39 +586,105 @@ extern "C" {
 #include <string.h>
 #include <time.h>
 
+#ifdef WFC_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
 const int alloc_inc = 4;
 
-// Dinamically adjust neighbor lists.
-// WARN: lists aren't guaranteed to be of the right size, have to adjust after.
-static int WFC__AddToNeighborList(WFC_State* wfc, int cellIdx, int neighborIdx, int rel)
+//------------------------------------------------------------------------------------------
+// Bitset helpers
+//------------------------------------------------------------------------------------------
+
+#if defined(__GNUC__) || defined(__clang__)
+#define WFC__POPCOUNT64(x) __builtin_popcountll(x)
+#define WFC__CTZ64(x) __builtin_ctzll(x)
+#else
+static inline int WFC__POPCOUNT64(uint64_t x)
 {
-    if (wfc->wave[cellIdx].neighbors == NULL)
-    {
-        wfc->wave[cellIdx].neighbors = WFC_CALLOC(alloc_inc, sizeof wfc->wave[cellIdx].neighbors[0]);
-        if (wfc->wave[cellIdx].neighbors == NULL)
-            return 1;
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (int) ((x * 0x0101010101010101ULL) >> 56);
+}
 
-        wfc->wave[cellIdx]._neighborCap = alloc_inc;
-    }
-    else if(wfc->wave[cellIdx].neighborCount == wfc->wave[cellIdx]._neighborCap)
-    {
-        wfc->wave[cellIdx]._neighborCap *= 2;
-        void* new_ptr = WFC_REALLOC(wfc->wave[cellIdx].neighbors, wfc->wave[cellIdx]._neighborCap * sizeof wfc->wave[cellIdx].neighbors[0]);
-        if (new_ptr == NULL)
-        {
-            WFC_FREE (wfc->wave[cellIdx].neighbors);
-            wfc->wave[cellIdx].neighbors = NULL;
-            return 1;
-        }
+static inline int WFC__CTZ64(uint64_t x)
+{
+    int n = 0;
+    while ((x & 1) == 0) { x >>= 1; n++; }
+    return n;
+}
+#endif
+
+// Sets the first "count" bits of the bitset, clearing the padding bits of the last word.
+static inline void WFC__BitsetFill(uint64_t* bits, int words, int count)
+{
+    memset(bits, 0xFF, words * sizeof bits[0]);
+    if (count & 63)
+        bits[words - 1] = (1ULL << (count & 63)) - 1;
+}
 
-        wfc->wave[cellIdx].neighbors = new_ptr;
+// Domain bitset of a cell
+static inline uint64_t* WFC__Domain(const WFC_State* wfc, int cellIdx)
+{
+    return &wfc->_domains[(size_t) cellIdx * wfc->tileWords];
+}
+
+// Sums of the weights and of weight * log(weight) over every tile
+static void WFC__FullSums(WFC_State* wfc)
+{
+    wfc->_fullSumWeights = 0;
+    wfc->_fullWeightLogWeightSum = 0;
+    for (int tc = 0; tc < wfc->tileCount; tc++)
+    {
+        wfc->_fullSumWeights += wfc->tileset[tc].weight;
+        wfc->_fullWeightLogWeightSum += wfc->tileset[tc].weight * log(wfc->tileset[tc].weight);
     }
+}
+
+// Grows the edges waiting for the next refit to fit at least "edgeCap" of them
+static int WFC__ReserveNewEdges(WFC_State* wfc, int edgeCap)
+{
+    if (edgeCap <= wfc->_newEdgeCap)
+        return 0;
+
+    WFC_Edge* new_ptr = WFC_REALLOC(wfc->_newEdges, edgeCap * sizeof wfc->_newEdges[0]);
+    if (new_ptr == NULL)
+        return 1;
+
+    wfc->_newEdges = new_ptr;
+    wfc->_newEdgeCap = edgeCap;
+    return 0;
+}
+
+static int WFC__PushEdge(WFC_State* wfc, WFC_Edge edge)
+{
+    if (wfc->_newEdgeCount == wfc->_newEdgeCap && WFC__ReserveNewEdges(wfc, wfc->_newEdgeCap > 0 ? wfc->_newEdgeCap * 2 : alloc_inc))
+        return 1;
 
-    wfc->wave[cellIdx].neighbors[wfc->wave[cellIdx].neighborCount  ].idx = neighborIdx;
-    wfc->wave[cellIdx].neighbors[wfc->wave[cellIdx].neighborCount++].rel = rel;
+    wfc->_newEdges[wfc->_newEdgeCount++] = edge;
+    wfc->_dirty = true;
     return 0;
 }
 
+static int WFC__AddToNeighborList(WFC_State* wfc, int cellIdx, int neighborIdx, int rel)
+{
+    return WFC__PushEdge(wfc, (WFC_Edge) { cellIdx, neighborIdx, rel, false });
+}
+
+// Connects two cells both ways. The way back uses the inverse of "rel" if it has one, else "rel" itself.
+static int WFC__AddPair(WFC_State* wfc, int cell1, int cell2, int rel)
+{
+    if (wfc->rules->inverse[rel] >= 0)
+        return WFC__PushEdge(wfc, (WFC_Edge) { cell1, cell2, rel, true });
+
+    if (WFC__AddToNeighborList(wfc, cell1, cell2, rel))
+        return 1;
+
+    return WFC__AddToNeighborList(wfc, cell2, cell1, rel);
+}
+
 static int WFC__NeighborSetup(WFC_State* wfc, RelationshipFunction relFunction)
 {
     const int wfcSize = wfc->cellCount;
@@ -199,630 +693,4272 @@ static int WFC__NeighborSetup(WFC_State* wfc, RelationshipFunction relFunction)
         for (int cell2 = cell1 + 1; cell2 < wfcSize; cell2++)
         {
             int rel = relFunction(wfc, cell1, cell2);
-            if (rel >= 0)
-            {
-                if (WFC__AddToNeighborList(wfc, cell1, cell2, rel))
-                    return 1;
-
-                if (WFC__AddToNeighborList(wfc, cell2, cell1, rel))
-                    return 1;
-            }
-        }
-    }
-
-    // Adjust the array sizes
-    for (int i = 0; i < wfcSize; i++)
-    {
-        if (wfc->wave[i].neighborCount < wfc->wave[i]._neighborCap)
-        {
-            wfc->wave[i]._neighborCap = wfc->wave[i].neighborCount;
-            void* new_ptr = WFC_REALLOC(wfc->wave[i].neighbors, wfc->wave[i]._neighborCap * sizeof wfc->wave[i].neighbors[0]);
-            if (new_ptr == NULL)
-            {
-                WFC_FREE(wfc->wave[i].neighbors);
-                wfc->wave[i].neighbors = NULL;
+            if (rel >= 0 && WFC__AddPair(wfc, cell1, cell2, rel))
                 return 1;
-            }
-
-            wfc->wave[i].neighbors = new_ptr;
         }
     }
 
     return 0;
 }
 
-void WFC_Init(WFC_State* wfc, Tile* tileset, int tileCount, int relCount)
+typedef struct
 {
-    assert(wfc != NULL);
-    assert(tileset != NULL);
-    assert(tileCount > 0);
-    assert(relCount > 0);
-    assert(!wfc->initialized);
-
-    srand(time(NULL));
-
-    // Setting the tilesets, size and relationship function/count
-    wfc->tileset = tileset;
-    wfc->tileCount = tileCount;
-    wfc->relCount = relCount;
-    wfc->cellCount = wfc->_cellCap = 0;
-    wfc->wave = NULL;
-
-#ifdef WFC_METRICS
-    wfc->totalIterations = 0;
-    wfc->totalPropagations = 0;
-    wfc->totalObservations = 0;
-    wfc->totalResets = 0;
-#endif
-
-    // NOTE: could I just use "1" instead of sizeof(char) ?
-    wfc->propagator = WFC_CALLOC(relCount * tileCount * tileCount, sizeof wfc->propagator[0]);
-    if (wfc->propagator == NULL)
-    {
-        goto prop_alloc_error;
-    }
-    // WARN: The propagator is set up with WFC_SetRule!
-
-    memset(wfc->props, 0, sizeof wfc->props);
-    wfc->propCount = 0;
+    int key;
+    int cell;
+} WFC__BucketEntry;
 
-    wfc->initialized = true;
-    wfc->isFinished = false;
-    wfc->_dirty = false;
-    return;
-
-// this cleanup is hella dirty. fix it
-neighbor_alloc_error:
-    //  iterate through all wave cells and free the non-nulls.
-    /* for (int i = 0; i < wfc->outputW * wfc->outputH; i++) */
-    /* { */
-    /*  if (wfc->wave[i].neighbors != NULL) */
-    /*      WFC_FREE(wfc->wave[i].neighbors); */
-    /* } */
-    WFC_FREE(wfc->propagator);
-prop_alloc_error:
-valid_tiles_alloc_error:
-    /* for (int i = 0; i < wfc->outputW * wfc->outputH; i++) */
-    /* { */
-    /*  if (wfc->wave[i].validTiles != NULL) */
-    /*      WFC_FREE(wfc->wave[i].validTiles); */
-    /* } */
-    /* WFC_FREE(wfc->wave); */
-wave_alloc_error:
-    return;
+static int WFC__CompareBucketEntries(const void* a, const void* b)
+{
+    const WFC__BucketEntry* ea = a;
+    const WFC__BucketEntry* eb = b;
+    if (ea->key != eb->key)
+        return ea->key < eb->key ? -1 : 1;
+    return (ea->cell > eb->cell) - (ea->cell < eb->cell);
 }
 
-// Internal reset. does not affect metrics
-void WFC__Reset(WFC_State* wfc)
+static int WFC__CompareEdges(const void* a, const void* b)
 {
-    assert(wfc != NULL);
+    const WFC_Edge* ea = a;
+    const WFC_Edge* eb = b;
+    if (ea->from != eb->from)
+        return ea->from < eb->from ? -1 : 1;
+    return (ea->to > eb->to) - (ea->to < eb->to);
+}
 
-    for (int i = 0; i < wfc->cellCount; i++)
+// Whether two key lists share a key smaller than "key", in which case the pair was already found in that bucket
+static bool WFC__SharesEarlierKey(const int* keysA, int countA, const int* keysB, int countB, int key)
+{
+    for (int i = 0; i < countA; i++)
     {
-        wfc->wave[i].isCollapsed = false;
-        wfc->wave[i].collapsedTile = -1;
-        wfc->wave[i].sumWeights = 0;
-        wfc->wave[i].weightLogWeightSum = 0;
-        for (int tc = 0; tc < wfc->tileCount; tc++)
+        if (keysA[i] >= key)
+            continue;
+        for (int j = 0; j < countB; j++)
         {
-            wfc->wave[i].validTiles[tc] = true;
-            wfc->wave[i].sumWeights += wfc->tileset[tc].weight;
-            wfc->wave[i].weightLogWeightSum += wfc->tileset[tc].weight * log(wfc->tileset[tc].weight);
+            if (keysB[j] == keysA[i])
+                return true;
         }
-        wfc->wave[i].validTileCount = wfc->tileCount;
     }
 
-    memset(wfc->props, 0, sizeof wfc->props);
-    wfc->propCount = 0;
-
-    for (int i = 0; i < wfc->cellCount; i++)
-    {
-        if (wfc->wave[i].initialTile > -1)
-            WFC_SetTileTo(wfc, i, wfc->wave[i].initialTile);
-    }
+    return false;
+}
 
-    wfc->initialized = true;
-    wfc->isFinished = false;
+// Calls the relationship function on a slice of the candidate pairs, storing the result in their "rel"
+typedef struct
+{
+    WFC_State* wfc;
+    RelationshipFunction relFunction;
+    WFC_Edge* pairs;
+    int begin;
+    int end;
+} WFC__RelateJob;
+
+static void* WFC__RelateWorker(void* arg)
+{
+    WFC__RelateJob* job = arg;
+    for (int p = job->begin; p < job->end; p++)
+        job->pairs[p].rel = job->relFunction(job->wfc, job->pairs[p].from, job->pairs[p].to);
+    return NULL;
 }
 
-// API reset. Clears up all the metrics, too!
-void WFC_Reset(WFC_State* wfc)
+static void WFC__ClearEdges(WFC_State* wfc)
 {
-    assert(wfc != NULL);
+    WFC_FREE(wfc->_adjOffsets);
+    WFC_FREE(wfc->_adjIdx);
+    WFC_FREE(wfc->_adjRel);
+    WFC_FREE(wfc->_newEdges);
+    wfc->_adjOffsets = wfc->_adjIdx = wfc->_adjRel = NULL;
+    wfc->_newEdges = NULL;
+    wfc->edgeCount = wfc->_adjCells = 0;
+    wfc->_newEdgeCount = wfc->_newEdgeCap = 0;
+}
 
-#ifdef WFC_METRICS
-    wfc->totalIterations = wfc->totalObservations = wfc->totalPropagations = wfc->totalResets = 0;
-#endif
+static inline int WFC__CompositePartCount(const WFC_State* wfc, int rel)
+{
+    if (rel < wfc->relCount)
+        return 1;
+    return wfc->_compositeOffsets[rel - wfc->relCount + 1] - wfc->_compositeOffsets[rel - wfc->relCount];
+}
 
-    WFC__Reset(wfc);
+// Returns the relationships a relationship stands for, using "buffer" for plain ones
+static inline const int* WFC__CompositeParts(const WFC_State* wfc, int rel, int* buffer)
+{
+    if (rel < wfc->relCount)
+    {
+        *buffer = rel;
+        return buffer;
+    }
+    return &wfc->_compositeParts[wfc->_compositeOffsets[rel - wfc->relCount]];
 }
 
-void WFC_CleanUp(WFC_State* wfc)
+// Returns the relationship of two parallel edges, reusing a composite with the same parts if there is one.
+// Returns -1 if there was an allocation error.
+static int WFC__MergeRels(WFC_State* wfc, int a, int b)
 {
-    assert(wfc != NULL);
+    if (a == b)
+        return a;
 
-    // Free the propagator
-    if (wfc->propagator != NULL)
+    if (wfc->_compositeOffsets == NULL)
     {
-        WFC_FREE(wfc->propagator);
-        wfc->propagator = NULL;
+        wfc->_compositeOffsets = WFC_CALLOC(1, sizeof wfc->_compositeOffsets[0]);
+        if (wfc->_compositeOffsets == NULL)
+            return -1;
     }
 
-    // Free the neighbors and validTiles in the wave
-    for (int i = 0; i < wfc->cellCount; i++)
+    // The merged parts are written after the last composite. A composite never has more parts than relationships.
+    const int start = wfc->_compositeOffsets[wfc->_compositeCount];
+    if (wfc->_compositePartCap < start + wfc->relCount)
     {
-        if (wfc->wave[i].validTiles != NULL)
-            WFC_FREE(wfc->wave[i].validTiles);
-        if (wfc->wave[i].neighbors != NULL)
-            WFC_FREE(wfc->wave[i].neighbors);
+        int newCap = start + wfc->relCount;
+        int* new_parts = WFC_REALLOC(wfc->_compositeParts, newCap * sizeof wfc->_compositeParts[0]);
+        if (new_parts == NULL)
+            return -1;
+        wfc->_compositeParts = new_parts;
+        wfc->_compositePartCap = newCap;
     }
 
-    // Free the wave
-    if (wfc->wave != NULL)
+    int aBuffer, bBuffer;
+    const int* aParts = WFC__CompositeParts(wfc, a, &aBuffer);
+    const int* bParts = WFC__CompositeParts(wfc, b, &bBuffer);
+    const int aCount = WFC__CompositePartCount(wfc, a);
+    const int bCount = WFC__CompositePartCount(wfc, b);
+    int* merged = &wfc->_compositeParts[start];
+    int count = 0, i = 0, j = 0;
+    while (i < aCount || j < bCount)
     {
-        WFC_FREE(wfc->wave);
-        wfc->wave = NULL;
+        int next = j >= bCount || (i < aCount && aParts[i] < bParts[j]) ? aParts[i++] : bParts[j++];
+        if (count == 0 || merged[count - 1] != next)
+            merged[count++] = next;
     }
-    wfc->initialized = false;
-    wfc->isFinished = false;
-    wfc->propCount = 0;
+
+    if (count == 1)
+        return merged[0];
+
+    for (int k = 0; k < wfc->_compositeCount; k++)
+    {
+        const int* parts = &wfc->_compositeParts[wfc->_compositeOffsets[k]];
+        if (wfc->_compositeOffsets[k + 1] - wfc->_compositeOffsets[k] == count && memcmp(parts, merged, count * sizeof merged[0]) == 0)
+            return wfc->relCount + k;
+    }
+
+    int* new_offsets = WFC_REALLOC(wfc->_compositeOffsets, (wfc->_compositeCount + 2) * sizeof wfc->_compositeOffsets[0]);
+    if (new_offsets == NULL)
+        return -1;
+    wfc->_compositeOffsets = new_offsets;
+    wfc->_compositeOffsets[++wfc->_compositeCount] = start + count;
+    return wfc->relCount + wfc->_compositeCount - 1;
 }
 
-int WFC_AddCell(WFC_State* wfc)
+static void WFC__ClearComposites(WFC_State* wfc)
 {
-    assert(wfc != NULL);
+    WFC_CleanUpRules(&wfc->_composites);
+    WFC_FREE(wfc->_compositeOffsets);
+    WFC_FREE(wfc->_compositeParts);
+    wfc->_compositeOffsets = wfc->_compositeParts = NULL;
+    wfc->_compositeCount = wfc->_compositePartCap = 0;
+}
 
-    if (!wfc->initialized)
-        return -1;
+// Merges the edges added since the last refit into the rows, keeping each cell's edges in insertion order.
+// Undirected edges are stored once until here, and go into the rows of both of their cells.
+// Parallel edges are merged into the first one, so that they are revised together.
+static int WFC__BuildAdjacency(WFC_State* wfc)
+{
+    if (wfc->_newEdgeCount == 0 && wfc->_adjCells == wfc->cellCount)
+        return 0;
 
-    if (wfc->wave == NULL)
+    const int cellCount = wfc->cellCount;
+    int edgeCount = wfc->edgeCount + wfc->_newEdgeCount;
+    for (int e = 0; e < wfc->_newEdgeCount; e++)
+        edgeCount += wfc->_newEdges[e].undirected;
+
+    int* offsets = WFC_CALLOC(cellCount + 1, sizeof offsets[0]);
+    int* cursor = WFC_MALLOC((cellCount + 1) * sizeof cursor[0]);
+    int* adjIdx = WFC_MALLOC((edgeCount + 1) * sizeof adjIdx[0]);
+    int* adjRel = WFC_MALLOC((edgeCount + 1) * sizeof adjRel[0]);
+    if (offsets == NULL || cursor == NULL || adjIdx == NULL || adjRel == NULL)
     {
-        wfc->wave = WFC_CALLOC(alloc_inc, sizeof wfc->wave[0]);
-        if (wfc->wave == NULL)
-        {
-            return -1;
-        }
+        WFC_FREE(offsets);
+        WFC_FREE(cursor);
+        WFC_FREE(adjIdx);
+        WFC_FREE(adjRel);
+        return 1;
+    }
 
-        wfc->_cellCap = alloc_inc;
+    // Count each cell's edges, then turn the counts into offsets
+    for (int c = 0; c < wfc->_adjCells; c++)
+        offsets[c + 1] = wfc->_adjOffsets[c + 1] - wfc->_adjOffsets[c];
+    for (int e = 0; e < wfc->_newEdgeCount; e++)
+    {
+        offsets[wfc->_newEdges[e].from + 1]++;
+        if (wfc->_newEdges[e].undirected)
+            offsets[wfc->_newEdges[e].to + 1]++;
     }
+    for (int c = 0; c < cellCount; c++)
+        offsets[c + 1] += offsets[c];
 
-    if (wfc->cellCount == wfc->_cellCap)
+    memcpy(cursor, offsets, (cellCount + 1) * sizeof cursor[0]);
+    for (int c = 0; c < wfc->_adjCells; c++)
     {
-        WFC_Cell* new_ptr = WFC_REALLOC(wfc->wave, wfc->_cellCap * 2 * sizeof wfc->wave[0]);
-        if (new_ptr == NULL)
+        for (int e = wfc->_adjOffsets[c]; e < wfc->_adjOffsets[c + 1]; e++)
         {
-            // Reallocate failed
-            return -1;
+            adjIdx[cursor[c]] = wfc->_adjIdx[e];
+            adjRel[cursor[c]++] = wfc->_adjRel[e];
         }
-
-        wfc->wave = new_ptr;
-        wfc->_cellCap *= 2;
     }
-
-    int idx = wfc->cellCount;
-
-    wfc->wave[idx].idx = idx;
-    wfc->wave[idx].isCollapsed = false;
-    wfc->wave[idx].collapsedTile = -1;
-    wfc->wave[idx].sumWeights = 0;
-    wfc->wave[idx].weightLogWeightSum = 0;
-    wfc->wave[idx].initialTile = -1;
-
-    // Allocate the valid tiles array
-    wfc->wave[idx].validTiles = WFC_MALLOC(sizeof(Tile) * wfc->tileCount);
-    if (wfc->wave[idx].validTiles == NULL)
+    for (int e = 0; e < wfc->_newEdgeCount; e++)
     {
-        return -1;
+        const WFC_Edge* edge = &wfc->_newEdges[e];
+        adjIdx[cursor[edge->from]] = edge->to;
+        adjRel[cursor[edge->from]++] = edge->rel;
+        if (edge->undirected)
+        {
+            adjIdx[cursor[edge->to]] = edge->from;
+            adjRel[cursor[edge->to]++] = wfc->rules->inverse[edge->rel];
+        }
     }
 
-    for (int tc = 0; tc < wfc->tileCount; tc++)
+    // Compact each row, using the cursors as the position of the kept edge towards each cell
+    int* keptEdge = cursor;
+    for (int c = 0; c < cellCount; c++)
+        keptEdge[c] = -1;
+
+    int kept = 0;
+    for (int c = 0; c < cellCount; c++)
     {
-        wfc->wave[idx].validTiles[tc] = true;
-        wfc->wave[idx].sumWeights += wfc->tileset[tc].weight;
-        wfc->wave[idx].weightLogWeightSum += wfc->tileset[tc].weight * log(wfc->tileset[tc].weight);
+        const int begin = offsets[c], end = offsets[c + 1];
+        offsets[c] = kept;
+        for (int e = begin; e < end; e++)
+        {
+            int to = adjIdx[e];
+            if (keptEdge[to] >= offsets[c])
+            {
+                int rel = WFC__MergeRels(wfc, adjRel[keptEdge[to]], adjRel[e]);
+                if (rel < 0)
+                {
+                    WFC_FREE(offsets);
+                    WFC_FREE(cursor);
+                    WFC_FREE(adjIdx);
+                    WFC_FREE(adjRel);
+                    return 1;
+                }
+                adjRel[keptEdge[to]] = rel;
+                continue;
+            }
+
+            keptEdge[to] = kept;
+            adjIdx[kept] = to;
+            adjRel[kept++] = adjRel[e];
+        }
+    }
+    offsets[cellCount] = kept;
+    WFC_FREE(cursor);
+
+    WFC__ClearEdges(wfc);
+    wfc->_adjOffsets = offsets;
+    wfc->_adjIdx = adjIdx;
+    wfc->_adjRel = adjRel;
+    wfc->edgeCount = kept;
+    wfc->_adjCells = cellCount;
+    return 0;
+}
+
+// Count of grid edges plus edges in the rows, which is how many edges support counts are kept for
+static inline int WFC__EdgeTotal(const WFC_State* wfc)
+{
+    return wfc->_gridCells * wfc->_gridDirs + wfc->edgeCount;
+}
+
+//------------------------------------------------------------------------------------------
+// Random numbers
+//------------------------------------------------------------------------------------------
+
+static inline uint64_t WFC__Rotl64(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+// xoshiro256**. Each state has its own generator, so states can run on different threads.
+static inline uint64_t WFC__Random(WFC_State* wfc)
+{
+    uint64_t* r = wfc->_rng;
+    const uint64_t result = WFC__Rotl64(r[1] * 5, 7) * 9;
+    const uint64_t t = r[1] << 17;
+
+    r[2] ^= r[0];
+    r[3] ^= r[1];
+    r[1] ^= r[2];
+    r[0] ^= r[3];
+    r[2] ^= t;
+    r[3] = WFC__Rotl64(r[3], 45);
+
+    return result;
+}
+
+// Uniform double in [0, 1)
+static inline double WFC__RandomDouble(WFC_State* wfc)
+{
+    return (WFC__Random(wfc) >> 11) * 0x1.0p-53;
+}
+
+// Tie-breaking noise added to a cell's entropy
+static inline double WFC__RandomNoise(WFC_State* wfc)
+{
+    return WFC__RandomDouble(wfc) * 0.01;
+}
+
+// Seeds the state's generator. The same seed, setup and calls give the same result.
+// Cells that already exist get their tie-breaking noise redrawn from the new seed.
+void WFC_Seed(WFC_State* wfc, uint64_t seed)
+{
+    assert(wfc != NULL);
+
+    // Expand the seed with splitmix64, which never yields an all-zero state
+    for (int i = 0; i < 4; i++)
+    {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        wfc->_rng[i] = z ^ (z >> 31);
+    }
+
+    for (int i = 0; i < wfc->cellCount; i++)
+        wfc->_noise[i] = WFC__RandomNoise(wfc);
+}
+
+//------------------------------------------------------------------------------------------
+// Rules
+//------------------------------------------------------------------------------------------
+
+void WFC_InitRules(WFC_Rules* rules, Tile* tileset, int tileCount, int relCount)
+{
+    assert(rules != NULL);
+    assert(tileset != NULL);
+    assert(tileCount > 0);
+    assert(relCount > 0);
+    assert(!rules->initialized);
+
+    rules->tileset = tileset;
+    rules->tileCount = tileCount;
+    rules->relCount = relCount;
+    rules->tileWords = (tileCount + 63) / 64;
+
+    // WARN: The propagator is set up with WFC_DefineRule!
+    rules->propagator = WFC_CALLOC(relCount * tileCount * rules->tileWords, sizeof rules->propagator[0]);
+    rules->inverse = WFC_MALLOC(relCount * sizeof rules->inverse[0]);
+    if (rules->propagator == NULL || rules->inverse == NULL)
+    {
+        WFC_FREE(rules->propagator);
+        WFC_FREE(rules->inverse);
+        rules->propagator = NULL;
+        rules->inverse = NULL;
+        return;
+    }
+    for (int r = 0; r < relCount; r++)
+        rules->inverse[r] = -1;
+
+    rules->compatOffsets = NULL;
+    rules->compat = NULL;
+    rules->fullSupports = NULL;
+    rules->relKinds = NULL;
+    rules->bannedOffsets = NULL;
+    rules->banned = NULL;
+    rules->maxBanned = NULL;
+
+    rules->compiled = false;
+    rules->initialized = true;
+}
+
+// Returns the packed row of tiles allowed at the destination when the source has tile "from".
+static inline uint64_t* WFC__RulesRow(const WFC_Rules* rules, int rel, int from)
+{
+    return &rules->propagator[(rel * rules->tileCount + from) * rules->tileWords];
+}
+
+static inline void WFC__SetRuleBit(WFC_Rules* rules, int rel, int from, int to, bool allowed)
+{
+    uint64_t* row = WFC__RulesRow(rules, rel, from);
+    uint64_t bit = 1ULL << (to & 63);
+    if (allowed)
+        row[to >> 6] |= bit;
+    else
+        row[to >> 6] &= ~bit;
+}
+
+// NOTE: should I pass in the tile, or the tile index?
+// Rules shared with WFC_InitShared must not change while states use them.
+// If the relationship has an inverse, the transposed rule is defined for it too.
+void WFC_DefineRule(WFC_Rules* rules, Tile sTile, Tile dTile, int rel, bool allowed)
+{
+    assert(rules != NULL && rules->initialized);
+    assert(sTile.val < rules->tileCount && dTile.val < rules->tileCount);
+
+    WFC__SetRuleBit(rules, rel, sTile.val, dTile.val, allowed);
+    if (rules->inverse[rel] >= 0)
+        WFC__SetRuleBit(rules, rules->inverse[rel], dTile.val, sTile.val, allowed);
+
+    rules->compiled = false;
+}
+
+// Declares "inverse" as the inverse of "rel", like LEFT of RIGHT. A relationship may be its own inverse.
+// Edges with either relationship then also connect their cells back with the other one,
+// and rules defined for either are also defined, transposed, for the other.
+// Rules already defined for one of the two are copied, transposed, into the other.
+void WFC_DefineInverse(WFC_Rules* rules, int rel, int inverse)
+{
+    assert(rules != NULL && rules->initialized);
+    assert(rel >= 0 && rel < rules->relCount && inverse >= 0 && inverse < rules->relCount);
+    assert(rules->inverse[rel] < 0 && rules->inverse[inverse] < 0);
+
+    rules->inverse[rel] = inverse;
+    rules->inverse[inverse] = rel;
+
+    for (int from = 0; from < rules->tileCount; from++)
+    {
+        for (int to = 0; to < rules->tileCount; to++)
+        {
+            if (WFC__RulesRow(rules, rel, from)[to >> 6] >> (to & 63) & 1)
+                WFC__SetRuleBit(rules, inverse, to, from, true);
+            if (WFC__RulesRow(rules, inverse, from)[to >> 6] >> (to & 63) & 1)
+                WFC__SetRuleBit(rules, rel, to, from, true);
+        }
+    }
+
+    rules->compiled = false;
+}
+
+static void WFC__FreeCompiledRules(WFC_Rules* rules)
+{
+    WFC_FREE(rules->compatOffsets);
+    WFC_FREE(rules->compat);
+    WFC_FREE(rules->fullSupports);
+    WFC_FREE(rules->relKinds);
+    WFC_FREE(rules->bannedOffsets);
+    WFC_FREE(rules->banned);
+    WFC_FREE(rules->maxBanned);
+    rules->compatOffsets = rules->compat = rules->fullSupports = NULL;
+    rules->relKinds = NULL;
+    rules->bannedOffsets = rules->banned = rules->maxBanned = NULL;
+    rules->compiled = false;
+}
+
+// Builds the compatibility lists from the propagator, and picks how each relationship is revised.
+// Must be called after the last WFC_DefineRule, before sharing the rules.
+int WFC_CompileRules(WFC_Rules* rules)
+{
+    assert(rules != NULL && rules->initialized);
+
+    const int tileCount = rules->tileCount;
+    const int rowCount = rules->relCount * tileCount;
+
+    WFC__FreeCompiledRules(rules);
+
+    rules->compatOffsets = WFC_MALLOC((rowCount + 1) * sizeof rules->compatOffsets[0]);
+    rules->fullSupports = WFC_CALLOC(rowCount, sizeof rules->fullSupports[0]);
+    if (rules->compatOffsets == NULL || rules->fullSupports == NULL)
+        goto alloc_error;
+
+    rules->compatOffsets[0] = 0;
+    for (int r = 0; r < rowCount; r++)
+    {
+        const uint64_t* row = &rules->propagator[r * rules->tileWords];
+        int count = 0;
+        for (int w = 0; w < rules->tileWords; w++)
+            count += WFC__POPCOUNT64(row[w]);
+        rules->compatOffsets[r + 1] = rules->compatOffsets[r] + count;
+    }
+
+    rules->compat = WFC_MALLOC((rules->compatOffsets[rowCount] + 1) * sizeof rules->compat[0]);
+    if (rules->compat == NULL)
+        goto alloc_error;
+
+    for (int r = 0; r < rowCount; r++)
+    {
+        const uint64_t* row = &rules->propagator[r * rules->tileWords];
+        int* compat = &rules->compat[rules->compatOffsets[r]];
+        int* fullSupports = &rules->fullSupports[(r / tileCount) * tileCount];
+        for (int w = 0; w < rules->tileWords; w++)
+        {
+            for (uint64_t bits = row[w]; bits != 0; bits &= bits - 1)
+            {
+                int t = w * 64 + WFC__CTZ64(bits);
+                *compat++ = t;
+                fullSupports[t]++;
+            }
+        }
+    }
+
+    // Merging a row costs tileWords operations and a list one per entry,
+    // so lists pay off once they are shorter than half a row on average
+    const long listBudget = (long) tileCount * rules->tileWords / 2;
+    rules->relKinds = WFC_MALLOC(rules->relCount * sizeof rules->relKinds[0]);
+    rules->maxBanned = WFC_CALLOC(rules->relCount, sizeof rules->maxBanned[0]);
+    rules->bannedOffsets = WFC_MALLOC((rowCount + 1) * sizeof rules->bannedOffsets[0]);
+    if (rules->relKinds == NULL || rules->maxBanned == NULL || rules->bannedOffsets == NULL)
+        goto alloc_error;
+
+    rules->bannedOffsets[0] = 0;
+    for (int rel = 0; rel < rules->relCount; rel++)
+    {
+        long allowedPairs = rules->compatOffsets[(rel + 1) * tileCount] - rules->compatOffsets[rel * tileCount];
+        long bannedPairs = (long) tileCount * tileCount - allowedPairs;
+
+        rules->relKinds[rel] = WFC_REL_DENSE;
+        if (bannedPairs == 0)
+            rules->relKinds[rel] = WFC_REL_TRIVIAL;
+        else if (allowedPairs < listBudget)
+            rules->relKinds[rel] = WFC_REL_SPARSE;
+        else if (bannedPairs < listBudget)
+            rules->relKinds[rel] = WFC_REL_COMPLEMENT;
+
+        for (int t = 0; t < tileCount; t++)
+        {
+            int r = rel * tileCount + t;
+            int count = rules->relKinds[rel] == WFC_REL_COMPLEMENT ? tileCount - rules->fullSupports[r] : 0;
+            rules->bannedOffsets[r + 1] = rules->bannedOffsets[r] + count;
+            if (count > rules->maxBanned[rel])
+                rules->maxBanned[rel] = count;
+        }
+    }
+
+    rules->banned = WFC_MALLOC((rules->bannedOffsets[rowCount] + 1) * sizeof rules->banned[0]);
+    if (rules->banned == NULL)
+        goto alloc_error;
+
+    for (int rel = 0; rel < rules->relCount; rel++)
+    {
+        if (rules->relKinds[rel] != WFC_REL_COMPLEMENT)
+            continue;
+
+        for (int t = 0; t < tileCount; t++)
+        {
+            int* banned = &rules->banned[rules->bannedOffsets[rel * tileCount + t]];
+            for (int from = 0; from < tileCount; from++)
+            {
+                if (!(WFC__RulesRow(rules, rel, from)[t >> 6] >> (t & 63) & 1))
+                    *banned++ = from;
+            }
+        }
+    }
+
+    rules->compiled = true;
+    return 0;
+
+alloc_error:
+    WFC__FreeCompiledRules(rules);
+    return 1;
+}
+
+void WFC_CleanUpRules(WFC_Rules* rules)
+{
+    assert(rules != NULL);
+
+    WFC__FreeCompiledRules(rules);
+    WFC_FREE(rules->propagator);
+    WFC_FREE(rules->inverse);
+    rules->propagator = NULL;
+    rules->inverse = NULL;
+    rules->initialized = false;
+}
+
+// Rebuilds the rows of every composite from the rows of its parts, which may have changed since the last refit
+static int WFC__BuildComposites(WFC_State* wfc)
+{
+    WFC_Rules* composites = &wfc->_composites;
+    WFC_CleanUpRules(composites);
+    if (wfc->_compositeCount == 0)
+        return 0;
+
+    const size_t relWords = (size_t) wfc->tileCount * wfc->tileWords;
+    composites->propagator = WFC_MALLOC(wfc->_compositeCount * relWords * sizeof composites->propagator[0]);
+    if (composites->propagator == NULL)
+        return 1;
+
+    composites->tileset = wfc->tileset;
+    composites->tileCount = wfc->tileCount;
+    composites->relCount = wfc->_compositeCount;
+    composites->tileWords = wfc->tileWords;
+    composites->compiled = false;
+    composites->initialized = true;
+
+    for (int k = 0; k < wfc->_compositeCount; k++)
+    {
+        uint64_t* rows = WFC__RulesRow(composites, k, 0);
+        const int* parts = &wfc->_compositeParts[wfc->_compositeOffsets[k]];
+        memcpy(rows, WFC__RulesRow(wfc->rules, parts[0], 0), relWords * sizeof rows[0]);
+        for (int p = wfc->_compositeOffsets[k] + 1; p < wfc->_compositeOffsets[k + 1]; p++)
+        {
+            const uint64_t* partRows = WFC__RulesRow(wfc->rules, wfc->_compositeParts[p], 0);
+            for (size_t i = 0; i < relWords; i++)
+                rows[i] &= partRows[i];
+        }
+    }
+
+    return 0;
+}
+
+// Returns the rules a relationship is in, turning it into an index into them
+static inline const WFC_Rules* WFC__RelRules(const WFC_State* wfc, int* rel)
+{
+    if (*rel < wfc->relCount)
+        return wfc->rules;
+
+    *rel -= wfc->relCount;
+    return &wfc->_composites;
+}
+
+// How the engines read a relationship. Rules that weren't compiled are always read as rows.
+static inline WFC_RelKind WFC__RelKind(const WFC_State* wfc, int rel)
+{
+    const WFC_Rules* rules = WFC__RelRules(wfc, &rel);
+    return rules->compiled ? rules->relKinds[rel] : WFC_REL_DENSE;
+}
+
+//------------------------------------------------------------------------------------------
+// State
+//------------------------------------------------------------------------------------------
+
+// Sets up everything in a state that doesn't depend on how its rules are owned.
+static int WFC__InitState(WFC_State* wfc, const WFC_Rules* rules)
+{
+    // Setting the tilesets, size and relationship count
+    wfc->rules = rules;
+    wfc->_ownedRules = NULL;
+    wfc->tileset = rules->tileset;
+    wfc->tileCount = rules->tileCount;
+    wfc->relCount = rules->relCount;
+    wfc->tileWords = rules->tileWords;
+    wfc->cellCount = wfc->_cellCap = 0;
+    wfc->_cells = NULL;
+    wfc->_entropy = wfc->_noise = NULL;
+    wfc->_initialTile = NULL;
+    wfc->_initialMasks = NULL;
+    wfc->_domains = NULL;
+    wfc->_domainsBlock = NULL;
+    WFC__FullSums(wfc);
+
+    // Seed from the clock and the state's address, so states initialized together don't share a sequence
+    WFC_Seed(wfc, (uint64_t) time(NULL) ^ (uint64_t) (uintptr_t) wfc);
+
+    wfc->_snapshotValid = false;
+    wfc->_snapDomains = NULL;
+    wfc->_snapCells = NULL;
+    wfc->_snapSupports = NULL;
+
+#ifdef WFC_METRICS
+    wfc->totalIterations = 0;
+    wfc->totalPropagations = 0;
+    wfc->totalObservations = 0;
+    wfc->totalResets = 0;
+    wfc->totalBacktracks = 0;
+#endif
+
+    wfc->_rowScratch = WFC_CALLOC(wfc->tileWords, sizeof wfc->_rowScratch[0]);
+    if (wfc->_rowScratch == NULL)
+        return 1;
+
+    wfc->propOrder = WFC_PROP_LIFO;
+    wfc->_propQueue = NULL;
+    wfc->_inPropQueue = NULL;
+    wfc->_propHead = wfc->propCount = wfc->_propCap = 0;
+
+    wfc->_heap = wfc->_heapPos = NULL;
+    wfc->_heapCount = wfc->_heapCap = 0;
+
+    wfc->_decisions = NULL;
+    wfc->_decisionCount = wfc->_decisionCap = 0;
+    wfc->_trail = NULL;
+    wfc->_trailTiles = NULL;
+    wfc->_trailCount = wfc->_trailCap = 0;
+    wfc->_trailFailed = false;
+    wfc->_savedLevel = NULL;
+    wfc->backtrackLimit = WFC_BACKTRACK_LIMIT;
+    wfc->_backtracks = 0;
+    wfc->_cancel = NULL;
+
+    wfc->_adjOffsets = wfc->_adjIdx = wfc->_adjRel = NULL;
+    wfc->_newEdges = NULL;
+    wfc->edgeCount = wfc->_adjCells = 0;
+    wfc->_newEdgeCount = wfc->_newEdgeCap = 0;
+    wfc->_compositeOffsets = wfc->_compositeParts = NULL;
+    wfc->_compositeCount = wfc->_compositePartCap = 0;
+    memset(&wfc->_composites, 0, sizeof wfc->_composites);
+    wfc->_gridCells = wfc->_gridDirs = 0;
+
+    wfc->engine = WFC_DEFAULT_ENGINE;
+    wfc->_supports = NULL;
+    wfc->_bans = NULL;
+    wfc->_banCount = wfc->_banCap = 0;
+
+    wfc->groupCount = 0;
+    wfc->_members = NULL;
+    wfc->_memberCount = wfc->_memberCap = 0;
+    wfc->_groupOffsets = wfc->_groupCells = NULL;
+    wfc->_cellGroupOffsets = wfc->_cellGroups = NULL;
+    wfc->_groupRowCells = 0;
+    wfc->_groupRules = NULL;
+    wfc->_groupRuleTiles = NULL;
+    wfc->_groupRuleCount = 0;
+    wfc->_groupTileCounts = NULL;
+    wfc->_groupEvents = NULL;
+    wfc->_groupEventCount = 0;
+    wfc->_groupQueue = NULL;
+    wfc->_inGroupQueue = NULL;
+    wfc->_groupQueueCount = 0;
+    wfc->_matchScratch = NULL;
+    wfc->_limits = NULL;
+    wfc->_limitCount = 0;
+    wfc->_limitOffsets = wfc->_limitsByTile = NULL;
+    wfc->_limitPlaced = wfc->_limitCandidates = NULL;
+    wfc->_limitQueue = NULL;
+    wfc->_inLimitQueue = NULL;
+    wfc->_limitQueueCount = 0;
+    wfc->_conns = NULL;
+    wfc->_connTiles = NULL;
+    wfc->_connCount = 0;
+    wfc->_connStates = NULL;
+    wfc->_connCells = 0;
+    wfc->_connAdjOffsets = wfc->_connAdj = wfc->_connAdjRel = NULL;
+    wfc->_connScratch = wfc->_connQueue = NULL;
+    wfc->_inConnQueue = NULL;
+    wfc->_connQueueCount = 0;
+
+    wfc->initialized = true;
+    wfc->isFinished = false;
+    wfc->_dirty = false;
+    return 0;
+}
+
+// Initializes a state with its own rules, set up with WFC_SetRule.
+void WFC_Init(WFC_State* wfc, Tile* tileset, int tileCount, int relCount)
+{
+    assert(wfc != NULL);
+    assert(!wfc->initialized);
+
+    WFC_Rules* rules = WFC_CALLOC(1, sizeof *rules);
+    if (rules == NULL)
+        return;
+
+    WFC_InitRules(rules, tileset, tileCount, relCount);
+    if (!rules->initialized || WFC__InitState(wfc, rules))
+    {
+        WFC_CleanUpRules(rules);
+        WFC_FREE(rules);
+        return;
+    }
+
+    wfc->_ownedRules = rules;
+}
+
+// Initializes a state that uses compiled rules owned by the caller.
+// The rules must outlive the state.
+void WFC_InitShared(WFC_State* wfc, const WFC_Rules* rules)
+{
+    assert(wfc != NULL);
+    assert(!wfc->initialized);
+    assert(rules != NULL && rules->initialized && rules->compiled);
+
+    WFC__InitState(wfc, rules);
+}
+
+int WFC__Propagate(WFC_State* wfc);
+static int WFC__InitSupports(WFC_State* wfc);
+static void WFC__GroupCollapsed(WFC_State* wfc, int cellIdx, int tile);
+static void WFC__CountGroupTiles(WFC_State* wfc, bool queue);
+static void WFC__FreeGroupRows(WFC_State* wfc);
+static void WFC__TouchGroups(WFC_State* wfc, int cellIdx);
+static void WFC__ClearGroupQueues(WFC_State* wfc);
+static void WFC__QueueAllGroups(WFC_State* wfc);
+static void WFC__FreeLimitRows(WFC_State* wfc);
+static int WFC__BuildLimits(WFC_State* wfc);
+static void WFC__CountLimits(WFC_State* wfc);
+static void WFC__LimitRemoved(WFC_State* wfc, int cellIdx, int tile);
+static void WFC__LimitCollapsed(WFC_State* wfc, int cellIdx, int tile);
+static void WFC__RestoreLimits(WFC_State* wfc, int cellIdx, const uint64_t* savedTiles, bool wasCollapsed);
+static void WFC__FreeConnRows(WFC_State* wfc);
+static int WFC__BuildConnectivity(WFC_State* wfc);
+static void WFC__CountConnectivity(WFC_State* wfc, bool queue);
+static void WFC__TouchConnectivity(WFC_State* wfc, int cellIdx, bool queue);
+static void WFC__ApplyInitial(WFC_State* wfc);
+
+// Whether group rules, tile limits or connectivity rules have work left
+static inline bool WFC__GlobalPropsLeft(const WFC_State* wfc)
+{
+    return wfc->_groupEventCount > 0 || wfc->_groupQueueCount > 0 || wfc->_limitQueueCount > 0 || wfc->_connQueueCount > 0;
+}
+
+// Whether the engine has propagations left, not counting group rules
+static inline bool WFC__EnginePropsLeft(const WFC_State* wfc)
+{
+    if (wfc->engine == WFC_ENGINE_AC4)
+        return wfc->_banCount > 0;
+    return wfc->propCount > 0;
+}
+
+static inline bool WFC__PropsLeft(WFC_State* wfc)
+{
+    return WFC__GlobalPropsLeft(wfc) || WFC__EnginePropsLeft(wfc);
+}
+
+//------------------------------------------------------------------------------------------
+// Observation heap
+//------------------------------------------------------------------------------------------
+
+static inline double WFC__CellEntropy(const WFC_State* wfc, int cellIdx)
+{
+    const WFC_CellState* cell = &wfc->_cells[cellIdx];
+    return log(cell->sumWeights) - cell->weightLogWeightSum / cell->sumWeights + wfc->_noise[cellIdx];
+}
+
+static inline void WFC__HeapSwap(WFC_State* wfc, int a, int b)
+{
+    int cellA = wfc->_heap[a], cellB = wfc->_heap[b];
+    wfc->_heap[a] = cellB;
+    wfc->_heap[b] = cellA;
+    wfc->_heapPos[cellB] = a;
+    wfc->_heapPos[cellA] = b;
+}
+
+static void WFC__HeapUp(WFC_State* wfc, int pos)
+{
+    while (pos > 0)
+    {
+        int parent = (pos - 1) / 2;
+        if (wfc->_entropy[wfc->_heap[parent]] <= wfc->_entropy[wfc->_heap[pos]])
+            break;
+        WFC__HeapSwap(wfc, pos, parent);
+        pos = parent;
+    }
+}
+
+static void WFC__HeapDown(WFC_State* wfc, int pos)
+{
+    for (;;)
+    {
+        int smallest = pos;
+        int left = 2 * pos + 1, right = left + 1;
+        if (left < wfc->_heapCount && wfc->_entropy[wfc->_heap[left]] < wfc->_entropy[wfc->_heap[smallest]])
+            smallest = left;
+        if (right < wfc->_heapCount && wfc->_entropy[wfc->_heap[right]] < wfc->_entropy[wfc->_heap[smallest]])
+            smallest = right;
+        if (smallest == pos)
+            break;
+        WFC__HeapSwap(wfc, pos, smallest);
+        pos = smallest;
+    }
+}
+
+static void WFC__HeapRemove(WFC_State* wfc, int cellIdx)
+{
+    int pos = wfc->_heapPos[cellIdx];
+    if (pos < 0)
+        return;
+
+    int last = --wfc->_heapCount;
+    if (pos != last)
+    {
+        WFC__HeapSwap(wfc, pos, last);
+        WFC__HeapUp(wfc, pos);
+        WFC__HeapDown(wfc, wfc->_heapPos[wfc->_heap[pos]]);
+    }
+    wfc->_heapPos[cellIdx] = -1;
+}
+
+// Call whenever a cell's weights change. Collapsed cells leave the heap.
+static inline void WFC__UpdateEntropy(WFC_State* wfc, int cellIdx)
+{
+    if (wfc->_heapPos == NULL || wfc->_heapPos[cellIdx] < 0)
+        return;
+
+    if (wfc->_cells[cellIdx].isCollapsed)
+    {
+        WFC__HeapRemove(wfc, cellIdx);
+        return;
+    }
+
+    double old = wfc->_entropy[cellIdx];
+    wfc->_entropy[cellIdx] = WFC__CellEntropy(wfc, cellIdx);
+    if (wfc->_entropy[cellIdx] < old)
+        WFC__HeapUp(wfc, wfc->_heapPos[cellIdx]);
+    else
+        WFC__HeapDown(wfc, wfc->_heapPos[cellIdx]);
+}
+
+// Rebuilds the heap from every uncollapsed cell.
+static void WFC__BuildHeap(WFC_State* wfc)
+{
+    // Cells added since the last refit don't fit yet. The refit will rebuild it.
+    if (wfc->_heap == NULL || wfc->_heapCap < wfc->cellCount)
+        return;
+
+    wfc->_heapCount = 0;
+    for (int i = 0; i < wfc->cellCount; i++)
+    {
+        wfc->_heapPos[i] = -1;
+        if (wfc->_cells[i].isCollapsed)
+            continue;
+
+        wfc->_entropy[i] = WFC__CellEntropy(wfc, i);
+        wfc->_heapPos[i] = wfc->_heapCount;
+        wfc->_heap[wfc->_heapCount++] = i;
+    }
+
+    for (int pos = wfc->_heapCount / 2 - 1; pos >= 0; pos--)
+        WFC__HeapDown(wfc, pos);
+}
+
+// Puts a cell that is no longer collapsed back in the heap, or updates its key.
+static void WFC__HeapRestore(WFC_State* wfc, int cellIdx)
+{
+    if (wfc->_cells[cellIdx].isCollapsed || wfc->_heapPos[cellIdx] >= 0)
+    {
+        WFC__UpdateEntropy(wfc, cellIdx);
+        return;
+    }
+
+    wfc->_entropy[cellIdx] = WFC__CellEntropy(wfc, cellIdx);
+    wfc->_heapPos[cellIdx] = wfc->_heapCount;
+    wfc->_heap[wfc->_heapCount++] = cellIdx;
+    WFC__HeapUp(wfc, wfc->_heapPos[cellIdx]);
+}
+
+//------------------------------------------------------------------------------------------
+// Trail
+//------------------------------------------------------------------------------------------
+
+// Records a cell before it changes, once per decision level.
+// Changes before the first decision are never undone, so they aren't recorded.
+static void WFC__Save(WFC_State* wfc, int cellIdx)
+{
+    int level = wfc->_decisionCount;
+    if (level == 0 || wfc->_savedLevel[cellIdx] == level || wfc->_trailFailed)
+        return;
+
+    if (wfc->_trailCount == wfc->_trailCap)
+    {
+        int newCap = wfc->_trailCap > 0 ? wfc->_trailCap * 2 : wfc->cellCount;
+        WFC_TrailEntry* new_trail = WFC_REALLOC(wfc->_trail, newCap * sizeof wfc->_trail[0]);
+        if (new_trail == NULL)
+        {
+            wfc->_trailFailed = true;
+            return;
+        }
+        wfc->_trail = new_trail;
+
+        uint64_t* new_tiles = WFC_REALLOC(wfc->_trailTiles, (size_t) newCap * wfc->tileWords * sizeof wfc->_trailTiles[0]);
+        if (new_tiles == NULL)
+        {
+            wfc->_trailFailed = true;
+            return;
+        }
+        wfc->_trailTiles = new_tiles;
+        wfc->_trailCap = newCap;
+    }
+
+    wfc->_trail[wfc->_trailCount] = (WFC_TrailEntry) { cellIdx, wfc->_savedLevel[cellIdx], wfc->_cells[cellIdx] };
+    memcpy(&wfc->_trailTiles[(size_t) wfc->_trailCount * wfc->tileWords], WFC__Domain(wfc, cellIdx), wfc->tileWords * sizeof wfc->_trailTiles[0]);
+    wfc->_trailCount++;
+    wfc->_savedLevel[cellIdx] = level;
+}
+
+static void WFC__FreeSnapshot(WFC_State* wfc)
+{
+    WFC_FREE(wfc->_snapDomains);
+    WFC_FREE(wfc->_snapCells);
+    WFC_FREE(wfc->_snapSupports);
+    wfc->_snapDomains = NULL;
+    wfc->_snapCells = NULL;
+    wfc->_snapSupports = NULL;
+    wfc->_snapshotValid = false;
+}
+
+// Saves the wave after a full reset, if it's settled and matches the current cells, edges and rules.
+static void WFC__TakeSnapshot(WFC_State* wfc)
+{
+    bool ac4 = wfc->engine == WFC_ENGINE_AC4;
+    if (wfc->_dirty || wfc->propCount > 0 || wfc->_banCount > 0 || WFC__GlobalPropsLeft(wfc) || (ac4 && wfc->_supports == NULL))
+        return;
+
+    WFC__FreeSnapshot(wfc);
+
+    const size_t domainWords = (size_t) wfc->cellCount * wfc->tileWords;
+    const size_t supportCount = (size_t) WFC__EdgeTotal(wfc) * wfc->tileCount;
+    wfc->_snapDomains = WFC_MALLOC((domainWords + 1) * sizeof wfc->_snapDomains[0]);
+    wfc->_snapCells = WFC_MALLOC((wfc->cellCount + 1) * sizeof wfc->_snapCells[0]);
+    if (ac4)
+        wfc->_snapSupports = WFC_MALLOC((supportCount + 1) * sizeof wfc->_snapSupports[0]);
+    if (wfc->_snapDomains == NULL || wfc->_snapCells == NULL || (ac4 && wfc->_snapSupports == NULL))
+    {
+        WFC__FreeSnapshot(wfc);
+        return;
+    }
+
+    memcpy(wfc->_snapDomains, wfc->_domains, domainWords * sizeof wfc->_snapDomains[0]);
+    memcpy(wfc->_snapCells, wfc->_cells, wfc->cellCount * sizeof wfc->_snapCells[0]);
+    if (ac4)
+        memcpy(wfc->_snapSupports, wfc->_supports, supportCount * sizeof wfc->_snapSupports[0]);
+    wfc->_snapshotValid = true;
+}
+
+// Internal reset. does not affect metrics
+void WFC__Reset(WFC_State* wfc)
+{
+    assert(wfc != NULL);
+
+    // Restore the snapshot if there's one, otherwise start from full domains and propagate the initial tiles
+    bool restore = wfc->_snapshotValid && !wfc->_dirty;
+    if (restore)
+    {
+        memcpy(wfc->_domains, wfc->_snapDomains, (size_t) wfc->cellCount * wfc->tileWords * sizeof wfc->_domains[0]);
+        memcpy(wfc->_cells, wfc->_snapCells, wfc->cellCount * sizeof wfc->_cells[0]);
+        if (wfc->_snapSupports != NULL)
+            memcpy(wfc->_supports, wfc->_snapSupports, (size_t) WFC__EdgeTotal(wfc) * wfc->tileCount * sizeof wfc->_supports[0]);
+    }
+    else
+    {
+        WFC__FullSums(wfc);
+        const WFC_CellState fullCell = { wfc->_fullWeightLogWeightSum, wfc->_fullSumWeights, wfc->tileCount, -1, false };
+        for (int i = 0; i < wfc->cellCount; i++)
+            wfc->_cells[i] = fullCell;
+
+        // Fill the first domain, then copy it over the rest in doubling chunks
+        if (wfc->cellCount > 0)
+        {
+            const size_t domainWords = wfc->tileWords;
+            const size_t totalWords = (size_t) wfc->cellCount * domainWords;
+            WFC__BitsetFill(wfc->_domains, wfc->tileWords, wfc->tileCount);
+            for (size_t filled = domainWords; filled < totalWords; filled *= 2)
+            {
+                size_t chunk = filled < totalWords - filled ? filled : totalWords - filled;
+                memcpy(&wfc->_domains[filled], wfc->_domains, chunk * sizeof wfc->_domains[0]);
+            }
+        }
+    }
+
+    for (int i = 0; i < wfc->cellCount; i++)
+        wfc->_noise[i] = WFC__RandomNoise(wfc);
+
+    WFC__BuildHeap(wfc);
+
+    wfc->_decisionCount = wfc->_trailCount = 0;
+    wfc->_trailFailed = false;
+    wfc->_backtracks = 0;
+    if (wfc->_savedLevel != NULL && wfc->_heapCap >= wfc->cellCount)
+        memset(wfc->_savedLevel, 0xFF, wfc->cellCount * sizeof wfc->_savedLevel[0]);
+
+    if (wfc->_inPropQueue != NULL)
+        memset(wfc->_inPropQueue, 0, wfc->_propCap * sizeof wfc->_inPropQueue[0]);
+    wfc->_propHead = wfc->propCount = 0;
+    wfc->_banCount = 0;
+    WFC__ClearGroupQueues(wfc);
+    WFC__CountGroupTiles(wfc, false);
+    WFC__CountLimits(wfc);
+    WFC__CountConnectivity(wfc, !restore);
+
+    if (!restore)
+    {
+        // Supports are only set up once the state has been refitted
+        if (wfc->engine == WFC_ENGINE_AC4 && wfc->_supports != NULL && !wfc->_dirty)
+            WFC__InitSupports(wfc);
+
+        WFC__ApplyInitial(wfc);
+
+        // AllDifferent rules can reduce full domains too, e.g. when a group has more cells than tiles
+        WFC__QueueAllGroups(wfc);
+        while (WFC__PropsLeft(wfc))
+        {
+            WFC__Propagate(wfc);
+        }
+
+        WFC__TakeSnapshot(wfc);
+    }
+
+    wfc->initialized = true;
+    wfc->isFinished = false;
+}
+
+// API reset. Clears up all the metrics, too!
+void WFC_Reset(WFC_State* wfc)
+{
+    assert(wfc != NULL);
+
+#ifdef WFC_METRICS
+    wfc->totalIterations = wfc->totalObservations = wfc->totalPropagations = wfc->totalResets = wfc->totalBacktracks = 0;
+#endif
+
+    WFC__Reset(wfc);
+}
+
+static void WFC__FreeSupports(WFC_State* wfc)
+{
+    WFC_FREE(wfc->_supports);
+    WFC_FREE(wfc->_bans);
+    wfc->_supports = NULL;
+    wfc->_bans = NULL;
+    wfc->_banCount = wfc->_banCap = 0;
+}
+
+void WFC_CleanUp(WFC_State* wfc)
+{
+    assert(wfc != NULL);
+
+    // Free the rules, unless they're shared
+    if (wfc->_ownedRules != NULL)
+    {
+        WFC_CleanUpRules(wfc->_ownedRules);
+        WFC_FREE(wfc->_ownedRules);
+        wfc->_ownedRules = NULL;
+    }
+    wfc->rules = NULL;
+
+    if (wfc->_rowScratch != NULL)
+    {
+        WFC_FREE(wfc->_rowScratch);
+        wfc->_rowScratch = NULL;
+    }
+
+    WFC__FreeSupports(wfc);
+
+    WFC__ClearEdges(wfc);
+
+    WFC__FreeGroupRows(wfc);
+    WFC_FREE(wfc->_members);
+    WFC_FREE(wfc->_groupRules);
+    WFC_FREE(wfc->_groupRuleTiles);
+    wfc->_members = NULL;
+    wfc->_groupRules = NULL;
+    wfc->_groupRuleTiles = NULL;
+    wfc->groupCount = wfc->_memberCount = wfc->_memberCap = wfc->_groupRuleCount = 0;
+
+    WFC__FreeLimitRows(wfc);
+    WFC_FREE(wfc->_limits);
+    wfc->_limits = NULL;
+    wfc->_limitCount = 0;
+
+    WFC__FreeConnRows(wfc);
+    WFC_FREE(wfc->_conns);
+    WFC_FREE(wfc->_connTiles);
+    wfc->_conns = NULL;
+    wfc->_connTiles = NULL;
+    wfc->_connCount = 0;
+
+    WFC__ClearComposites(wfc);
+
+    WFC__FreeSnapshot(wfc);
+
+    // Free the domains
+    WFC_FREE(wfc->_domainsBlock);
+    wfc->_domains = NULL;
+    wfc->_domainsBlock = NULL;
+
+    // Free the wave
+    WFC_FREE(wfc->_cells);
+    WFC_FREE(wfc->_entropy);
+    WFC_FREE(wfc->_noise);
+    WFC_FREE(wfc->_initialTile);
+    WFC_FREE(wfc->_initialMasks);
+    wfc->_cells = NULL;
+    wfc->_entropy = wfc->_noise = NULL;
+    wfc->_initialTile = NULL;
+    wfc->_initialMasks = NULL;
+    // Free the observation heap
+    if (wfc->_heap != NULL)
+    {
+        WFC_FREE(wfc->_heap);
+        wfc->_heap = NULL;
+    }
+    if (wfc->_heapPos != NULL)
+    {
+        WFC_FREE(wfc->_heapPos);
+        wfc->_heapPos = NULL;
+    }
+    wfc->_heapCount = wfc->_heapCap = 0;
+
+    // Free the backtracking data
+    WFC_FREE(wfc->_decisions);
+    WFC_FREE(wfc->_trail);
+    WFC_FREE(wfc->_trailTiles);
+    WFC_FREE(wfc->_savedLevel);
+    wfc->_decisions = NULL;
+    wfc->_trail = NULL;
+    wfc->_trailTiles = NULL;
+    wfc->_savedLevel = NULL;
+    wfc->_decisionCount = wfc->_decisionCap = wfc->_trailCount = wfc->_trailCap = 0;
+
+    // Free the propagation queue
+    if (wfc->_propQueue != NULL)
+    {
+        WFC_FREE(wfc->_propQueue);
+        wfc->_propQueue = NULL;
+    }
+    if (wfc->_inPropQueue != NULL)
+    {
+        WFC_FREE(wfc->_inPropQueue);
+        wfc->_inPropQueue = NULL;
+    }
+
+    wfc->initialized = false;
+    wfc->isFinished = false;
+    wfc->_propHead = wfc->propCount = wfc->_propCap = 0;
+}
+
+// Grows the wave and the domain slab to fit at least "cellCap" cells.
+// Returns 1 if they couldn't be allocated.
+int WFC_ReserveCells(WFC_State* wfc, int cellCap)
+{
+    assert(wfc != NULL && wfc->initialized);
+
+    if (cellCap <= wfc->_cellCap)
+        return 0;
+
+    WFC_CellState* new_cells = WFC_REALLOC(wfc->_cells, cellCap * sizeof wfc->_cells[0]);
+    if (new_cells == NULL)
+        return 1;
+    wfc->_cells = new_cells;
+
+    double* new_entropy = WFC_REALLOC(wfc->_entropy, cellCap * sizeof wfc->_entropy[0]);
+    if (new_entropy == NULL)
+        return 1;
+    wfc->_entropy = new_entropy;
+
+    double* new_noise = WFC_REALLOC(wfc->_noise, cellCap * sizeof wfc->_noise[0]);
+    if (new_noise == NULL)
+        return 1;
+    wfc->_noise = new_noise;
+
+    int* new_initial = WFC_REALLOC(wfc->_initialTile, cellCap * sizeof wfc->_initialTile[0]);
+    if (new_initial == NULL)
+        return 1;
+    wfc->_initialTile = new_initial;
+
+    if (wfc->_initialMasks != NULL)
+    {
+        uint64_t* new_masks = WFC_REALLOC(wfc->_initialMasks, (size_t) cellCap * wfc->tileWords * sizeof wfc->_initialMasks[0]);
+        if (new_masks == NULL)
+            return 1;
+        wfc->_initialMasks = new_masks;
+    }
+
+    // Aligned by hand, since WFC_MALLOC may not support alignment
+    void* block = WFC_MALLOC((size_t) cellCap * wfc->tileWords * sizeof wfc->_domains[0] + WFC_DOMAIN_ALIGN);
+    if (block == NULL)
+        return 1;
+    uint64_t* domains = (uint64_t*) (((uintptr_t) block + WFC_DOMAIN_ALIGN - 1) & ~(uintptr_t) (WFC_DOMAIN_ALIGN - 1));
+
+    if (wfc->_domains != NULL)
+        memcpy(domains, wfc->_domains, (size_t) wfc->cellCount * wfc->tileWords * sizeof domains[0]);
+    WFC_FREE(wfc->_domainsBlock);
+
+    wfc->_domains = domains;
+    wfc->_domainsBlock = block;
+    wfc->_cellCap = cellCap;
+    return 0;
+}
+
+int WFC_AddCell(WFC_State* wfc)
+{
+    assert(wfc != NULL);
+
+    if (!wfc->initialized)
+        return -1;
+
+    if (wfc->cellCount == wfc->_cellCap && WFC_ReserveCells(wfc, wfc->_cellCap > 0 ? wfc->_cellCap * 2 : alloc_inc))
+        return -1;
+
+    int idx = wfc->cellCount;
+
+    wfc->_cells[idx] = (WFC_CellState) { wfc->_fullWeightLogWeightSum, wfc->_fullSumWeights, wfc->tileCount, -1, false };
+    wfc->_initialTile[idx] = -1;
+    if (wfc->_initialMasks != NULL)
+        WFC__BitsetFill(&wfc->_initialMasks[(size_t) idx * wfc->tileWords], wfc->tileWords, wfc->tileCount);
+    wfc->_noise[idx] = WFC__RandomNoise(wfc);
+    WFC__BitsetFill(WFC__Domain(wfc, idx), wfc->tileWords, wfc->tileCount);
+
+    wfc->cellCount++;
+    wfc->_dirty = true;
+
+    return idx;
+}
+
+// Adds "count" cells at once, allocating the wave a single time.
+// Returns the index of the first new cell, or -1 if they couldn't be allocated.
+int WFC_AddCells(WFC_State* wfc, int count)
+{
+    assert(wfc != NULL);
+    assert(count >= 0);
+
+    if (!wfc->initialized)
+        return -1;
+
+    const int first = wfc->cellCount;
+    if (WFC_ReserveCells(wfc, first + count))
+        return -1;
+
+    const WFC_CellState fresh = { wfc->_fullWeightLogWeightSum, wfc->_fullSumWeights, wfc->tileCount, -1, false };
+    for (int idx = first; idx < first + count; idx++)
+    {
+        wfc->_cells[idx] = fresh;
+        wfc->_initialTile[idx] = -1;
+        if (wfc->_initialMasks != NULL)
+            WFC__BitsetFill(&wfc->_initialMasks[(size_t) idx * wfc->tileWords], wfc->tileWords, wfc->tileCount);
+        wfc->_noise[idx] = WFC__RandomNoise(wfc);
+        WFC__BitsetFill(WFC__Domain(wfc, idx), wfc->tileWords, wfc->tileCount);
+    }
+
+    wfc->cellCount += count;
+    wfc->_dirty = true;
+
+    return first;
+}
+
+int WFC_AddNeighbor(WFC_State* wfc, int idxCell, int idxNeighbor, int rel)
+{
+    assert (wfc != NULL);
+    assert (idxCell >= 0 && idxNeighbor >= 0);
+
+    /* if (idxCell >= wfc->tileCount || idxNeighbor >= wfc->tileCount) */
+    /*  return 1; */
+
+    /* if (rel < 0) */
+    /*  rel = wfc->relFunction(wfc, idxCell, idxNeighbor); */
+
+    // With an inverse, the edge also connects the neighbor back
+    return WFC__PushEdge(wfc, (WFC_Edge) { idxCell, idxNeighbor, rel, wfc->rules->inverse[rel] >= 0 });
+}
+
+// Makes room for "edgeCap" edges added with WFC_AddNeighbor before the next refit.
+// Returns 1 if they couldn't be allocated.
+int WFC_ReserveEdges(WFC_State* wfc, int edgeCap)
+{
+    assert(wfc != NULL && wfc->initialized);
+
+    return WFC__ReserveNewEdges(wfc, edgeCap);
+}
+
+// Adds the edges from[i] -> to[i] with relationship rels[i], growing the edge list once.
+// Like WFC_AddNeighbor, edges whose relationship has an inverse also connect to[i] back to from[i].
+// The edges are merged into the rows together on the next refit.
+// Returns 1 if they couldn't be allocated, in which case no edge is added.
+int WFC_AddEdges(WFC_State* wfc, const int* from, const int* to, const int* rels, int count)
+{
+    assert(wfc != NULL && wfc->initialized);
+    assert(count >= 0);
+
+    if (WFC__ReserveNewEdges(wfc, wfc->_newEdgeCount + count))
+        return 1;
+
+    WFC_Edge* edges = &wfc->_newEdges[wfc->_newEdgeCount];
+    for (int e = 0; e < count; e++)
+    {
+        assert(from[e] >= 0 && to[e] >= 0);
+        edges[e] = (WFC_Edge) { from[e], to[e], rels[e], wfc->rules->inverse[rels[e]] >= 0 };
+    }
+
+    wfc->_newEdgeCount += count;
+    wfc->_dirty = true;
+    return 0;
+}
+
+int WFC_CalculateNeighbors(WFC_State* wfc, RelationshipFunction relFunc)
+{
+    assert (wfc != NULL);
+
+    // Replaces every edge added so far
+    WFC__ClearEdges(wfc);
+    wfc->_dirty = true;
+
+    return WFC__NeighborSetup(wfc, relFunc);
+}
+
+// Like WFC_CalculateNeighbors, but the relationship function is only called on cells that share a bucket,
+// so the cost grows with the pairs in each bucket instead of with the square of the cell count.
+// "bucketFunc" writes at most "maxKeys" keys per cell. Edges are added in the same order as
+// WFC_CalculateNeighbors would add them. With WFC_THREADS, the relationship function is called from up
+// to "threadCount" threads, so it has to be thread safe.
+// Returns 1 if there was an allocation error.
+int WFC_CalculateNeighborsBucketed(WFC_State* wfc, RelationshipFunction relFunc, BucketFunction bucketFunc, int maxKeys, int threadCount)
+{
+    assert(wfc != NULL);
+    assert(maxKeys > 0);
+
+    // Replaces every edge added so far
+    WFC__ClearEdges(wfc);
+    wfc->_dirty = true;
+
+    const int cellCount = wfc->cellCount;
+    int err = 1;
+    int entryCount = 0;
+    int pairCount = 0, pairCap = 0;
+    WFC_Edge* pairs = NULL;
+    WFC__RelateJob* jobs = NULL;
+    int* keys = WFC_MALLOC(((size_t) cellCount * maxKeys + 1) * sizeof keys[0]);
+    int* keyCounts = WFC_MALLOC((cellCount + 1) * sizeof keyCounts[0]);
+    WFC__BucketEntry* entries = WFC_MALLOC(((size_t) cellCount * maxKeys + 1) * sizeof entries[0]);
+    if (keys == NULL || keyCounts == NULL || entries == NULL)
+        goto bucket_cleanup;
+
+    for (int c = 0; c < cellCount; c++)
+    {
+        int* cellKeys = &keys[(size_t) c * maxKeys];
+        int count = bucketFunc(wfc, c, cellKeys);
+        keyCounts[c] = count < 0 ? 0 : count > maxKeys ? maxKeys : count;
+        for (int k = 0; k < keyCounts[c]; k++)
+            entries[entryCount++] = (WFC__BucketEntry) { cellKeys[k], c };
+    }
+
+    // Sort by bucket, dropping a cell's repeated keys
+    qsort(entries, entryCount, sizeof entries[0], WFC__CompareBucketEntries);
+    int uniqueCount = 0;
+    for (int i = 0; i < entryCount; i++)
+    {
+        if (uniqueCount == 0 || entries[i].key != entries[uniqueCount - 1].key || entries[i].cell != entries[uniqueCount - 1].cell)
+            entries[uniqueCount++] = entries[i];
+    }
+    entryCount = uniqueCount;
+
+    // Every pair in a bucket is a candidate, taken only from the first bucket the two cells share
+    for (int start = 0; start < entryCount;)
+    {
+        int end = start + 1;
+        while (end < entryCount && entries[end].key == entries[start].key)
+            end++;
+
+        for (int i = start; i < end; i++)
+        {
+            int a = entries[i].cell;
+            for (int j = i + 1; j < end; j++)
+            {
+                int b = entries[j].cell;
+                if (WFC__SharesEarlierKey(&keys[(size_t) a * maxKeys], keyCounts[a], &keys[(size_t) b * maxKeys], keyCounts[b], entries[i].key))
+                    continue;
+
+                if (pairCount == pairCap)
+                {
+                    int newCap = pairCap > 0 ? pairCap * 2 : alloc_inc;
+                    WFC_Edge* new_ptr = WFC_REALLOC(pairs, newCap * sizeof pairs[0]);
+                    if (new_ptr == NULL)
+                        goto bucket_cleanup;
+
+                    pairs = new_ptr;
+                    pairCap = newCap;
+                }
+                pairs[pairCount++] = (WFC_Edge) { a, b, -1, false };
+            }
+        }
+
+        start = end;
+    }
+
+    // Same order as the pairwise scan
+    qsort(pairs, pairCount, sizeof pairs[0], WFC__CompareEdges);
+
+#ifdef WFC_THREADS
+    // Small graphs aren't worth the threads
+    if (threadCount > pairCount / 1024)
+        threadCount = pairCount / 1024;
+    if (threadCount < 1)
+        threadCount = 1;
+#else
+    threadCount = 1;
+#endif
+
+    jobs = WFC_MALLOC(threadCount * sizeof jobs[0]);
+    if (jobs == NULL)
+        goto bucket_cleanup;
+    for (int w = 0; w < threadCount; w++)
+        jobs[w] = (WFC__RelateJob) { wfc, relFunc, pairs, (int) ((long long) pairCount * w / threadCount), (int) ((long long) pairCount * (w + 1) / threadCount) };
+
+#ifdef WFC_THREADS
+    pthread_t* threads = WFC_MALLOC(threadCount * sizeof threads[0]);
+    if (threads == NULL)
+        goto bucket_cleanup;
+
+    // The calling thread works too, and takes over the slices of threads that didn't start
+    int started = 1;
+    for (; started < threadCount; started++)
+    {
+        if (pthread_create(&threads[started], NULL, WFC__RelateWorker, &jobs[started]) != 0)
+            break;
+    }
+    WFC__RelateWorker(&jobs[0]);
+    for (int w = started; w < threadCount; w++)
+        WFC__RelateWorker(&jobs[w]);
+    for (int w = 1; w < started; w++)
+        pthread_join(threads[w], NULL);
+    WFC_FREE(threads);
+#else
+    WFC__RelateWorker(&jobs[0]);
+#endif
+
+    for (int p = 0; p < pairCount; p++)
+    {
+        if (pairs[p].rel >= 0 && WFC__AddPair(wfc, pairs[p].from, pairs[p].to, pairs[p].rel))
+            goto bucket_cleanup;
+    }
+    err = 0;
+
+bucket_cleanup:
+    WFC_FREE(keys);
+    WFC_FREE(keyCounts);
+    WFC_FREE(entries);
+    WFC_FREE(pairs);
+    WFC_FREE(jobs);
+    return err;
+}
+
+static void WFC__FreeGroupRows(WFC_State* wfc)
+{
+    WFC_FREE(wfc->_groupOffsets);
+    WFC_FREE(wfc->_groupCells);
+    WFC_FREE(wfc->_cellGroupOffsets);
+    WFC_FREE(wfc->_cellGroups);
+    WFC_FREE(wfc->_groupTileCounts);
+    WFC_FREE(wfc->_groupEvents);
+    WFC_FREE(wfc->_groupQueue);
+    WFC_FREE(wfc->_inGroupQueue);
+    WFC_FREE(wfc->_matchScratch);
+    wfc->_groupOffsets = wfc->_groupCells = NULL;
+    wfc->_cellGroupOffsets = wfc->_cellGroups = NULL;
+    wfc->_groupTileCounts = NULL;
+    wfc->_groupEvents = NULL;
+    wfc->_groupQueue = wfc->_matchScratch = NULL;
+    wfc->_inGroupQueue = NULL;
+    wfc->_groupRowCells = wfc->_groupEventCount = wfc->_groupQueueCount = 0;
+}
+
+// Sorts the memberships into rows, by group if "byGroup" is set and by cell otherwise, keeping the order they were added in.
+static void WFC__GroupRows(const WFC_State* wfc, int rowCount, bool byGroup, int* offsets, int* values)
+{
+    memset(offsets, 0, (rowCount + 1) * sizeof offsets[0]);
+    for (int m = 0; m < wfc->_memberCount; m++)
+        offsets[(byGroup ? wfc->_members[m].group : wfc->_members[m].cell) + 1]++;
+    for (int r = 0; r < rowCount; r++)
+        offsets[r + 1] += offsets[r];
+
+    // Filling a row moves its offset to where the next row starts, so shift them back after
+    for (int m = 0; m < wfc->_memberCount; m++)
+    {
+        const WFC_GroupMember* member = &wfc->_members[m];
+        values[offsets[byGroup ? member->group : member->cell]++] = byGroup ? member->cell : member->group;
+    }
+    memmove(&offsets[1], offsets, rowCount * sizeof offsets[0]);
+    offsets[0] = 0;
+}
+
+// Rebuilds the group rows and tile counters. Called on refit.
+static int WFC__BuildGroups(WFC_State* wfc)
+{
+    WFC__FreeGroupRows(wfc);
+    if (wfc->groupCount == 0)
+        return 0;
+
+    const size_t counterCount = (size_t) wfc->groupCount * wfc->tileCount;
+    wfc->_groupOffsets = WFC_MALLOC((wfc->groupCount + 1) * sizeof wfc->_groupOffsets[0]);
+    wfc->_groupCells = WFC_MALLOC((wfc->_memberCount + 1) * sizeof wfc->_groupCells[0]);
+    wfc->_cellGroupOffsets = WFC_MALLOC((wfc->cellCount + 1) * sizeof wfc->_cellGroupOffsets[0]);
+    wfc->_cellGroups = WFC_MALLOC((wfc->_memberCount + 1) * sizeof wfc->_cellGroups[0]);
+    wfc->_groupTileCounts = WFC_MALLOC((counterCount + 1) * sizeof wfc->_groupTileCounts[0]);
+    wfc->_groupEvents = WFC_MALLOC((counterCount + 1) * sizeof wfc->_groupEvents[0]);
+    if (wfc->_groupOffsets == NULL || wfc->_groupCells == NULL || wfc->_cellGroupOffsets == NULL
+        || wfc->_cellGroups == NULL || wfc->_groupTileCounts == NULL || wfc->_groupEvents == NULL)
+    {
+        WFC__FreeGroupRows(wfc);
+        return 1;
+    }
+
+    WFC__GroupRows(wfc, wfc->groupCount, true, wfc->_groupOffsets, wfc->_groupCells);
+    WFC__GroupRows(wfc, wfc->cellCount, false, wfc->_cellGroupOffsets, wfc->_cellGroups);
+    wfc->_groupRowCells = wfc->cellCount;
+
+    bool allDifferent = false;
+    for (int r = 0; r < wfc->_groupRuleCount; r++)
+        allDifferent |= wfc->_groupRules[r] == WFC_GROUP_ALL_DIFFERENT;
+
+    if (allDifferent)
+    {
+        int largestGroup = 0;
+        for (int g = 0; g < wfc->groupCount; g++)
+        {
+            if (wfc->_groupOffsets[g + 1] - wfc->_groupOffsets[g] > largestGroup)
+                largestGroup = wfc->_groupOffsets[g + 1] - wfc->_groupOffsets[g];
+        }
+
+        wfc->_groupQueue = WFC_MALLOC(wfc->groupCount * sizeof wfc->_groupQueue[0]);
+        wfc->_inGroupQueue = WFC_CALLOC(wfc->groupCount, sizeof wfc->_inGroupQueue[0]);
+        wfc->_matchScratch = WFC_MALLOC(7 * (size_t) (largestGroup + wfc->tileCount) * sizeof wfc->_matchScratch[0]);
+        if (wfc->_groupQueue == NULL || wfc->_inGroupQueue == NULL || wfc->_matchScratch == NULL)
+        {
+            WFC__FreeGroupRows(wfc);
+            return 1;
+        }
+
+        // Domains may already be reduced, so check every group
+        WFC__QueueAllGroups(wfc);
+    }
+
+    // Cells may already be collapsed, so their rules are applied on the next propagation
+    WFC__CountGroupTiles(wfc, true);
+    return 0;
+}
+
+// Adds an empty group of cells. Returns its index, or -1 on error.
+int WFC_AddGroup(WFC_State* wfc)
+{
+    assert(wfc != NULL);
+
+    if (!wfc->initialized)
+        return -1;
+
+    wfc->_dirty = true;
+    return wfc->groupCount++;
+}
+
+// Adds a cell to a group. A cell can be in any number of groups.
+// Returns 1 if there was an allocation error.
+int WFC_AddToGroup(WFC_State* wfc, int groupIdx, int cellIdx)
+{
+    assert(wfc != NULL && wfc->initialized);
+    assert(groupIdx >= 0 && groupIdx < wfc->groupCount);
+    assert(cellIdx >= 0 && cellIdx < wfc->cellCount);
+
+    if (wfc->_memberCount == wfc->_memberCap)
+    {
+        int newCap = wfc->_memberCap > 0 ? wfc->_memberCap * 2 : alloc_inc;
+        WFC_GroupMember* new_ptr = WFC_REALLOC(wfc->_members, newCap * sizeof wfc->_members[0]);
+        if (new_ptr == NULL)
+            return 1;
+
+        wfc->_members = new_ptr;
+        wfc->_memberCap = newCap;
+    }
+
+    wfc->_members[wfc->_memberCount++] = (WFC_GroupMember) { cellIdx, groupIdx };
+    wfc->_dirty = true;
+    return 0;
+}
+
+// Adds a rule over a set of tiles, applied to every group.
+// Returns 1 if there was an allocation error.
+int WFC_AddGroupRule(WFC_State* wfc, WFC_GroupRule rule, const int* tiles, int count)
+{
+    assert(wfc != NULL && wfc->initialized);
+    assert(tiles != NULL || count == 0);
+
+    WFC_GroupRule* new_rules = WFC_REALLOC(wfc->_groupRules, (wfc->_groupRuleCount + 1) * sizeof wfc->_groupRules[0]);
+    if (new_rules == NULL)
+        return 1;
+    wfc->_groupRules = new_rules;
+
+    uint64_t* new_tiles = WFC_REALLOC(wfc->_groupRuleTiles, (size_t) (wfc->_groupRuleCount + 1) * wfc->tileWords * sizeof wfc->_groupRuleTiles[0]);
+    if (new_tiles == NULL)
+        return 1;
+    wfc->_groupRuleTiles = new_tiles;
+
+    uint64_t* ruleTiles = &wfc->_groupRuleTiles[(size_t) wfc->_groupRuleCount * wfc->tileWords];
+    memset(ruleTiles, 0, wfc->tileWords * sizeof ruleTiles[0]);
+    for (int i = 0; i < count; i++)
+    {
+        assert(tiles[i] >= 0 && tiles[i] < wfc->tileCount);
+        ruleTiles[tiles[i] >> 6] |= 1ULL << (tiles[i] & 63);
+    }
+
+    wfc->_groupRules[wfc->_groupRuleCount++] = rule;
+    wfc->_dirty = true;
+    return 0;
+}
+
+// Adds the cells of a grid, whose neighbors are computed on the fly instead of stored.
+// Must be called before any other cell is added. More edges can still be added with WFC_AddNeighbor.
+// Returns 1 if the cells couldn't be allocated.
+int WFC_SetGrid(WFC_State* wfc, const WFC_Grid* grid)
+{
+    assert(wfc != NULL && wfc->initialized);
+    assert(wfc->cellCount == 0 && wfc->_gridCells == 0);
+    assert(grid->width > 0 && grid->height > 0 && grid->depth > 0);
+
+    const int cellCount = grid->width * grid->height * grid->depth;
+    if (WFC_AddCells(wfc, cellCount) < 0)
+        return 1;
+
+    wfc->_grid = *grid;
+    wfc->_gridCells = cellCount;
+    wfc->_gridDirs = grid->depth > 1 ? 6 : 4;
+    wfc->_dirty = true;
+    return 0;
+}
+
+static int WFC__CompileOwnRules(WFC_State* wfc);
+static int WFC__SetupSupports(WFC_State* wfc);
+
+// Updates all cells in the WFC state if dirty, refitting dynamic arrays and recalculating neighbors.
+// FIXME: I'm not treating this function's error case well enough in its usages!
+static int WFC__RefitState (WFC_State* wfc)
+{
+    assert(wfc != NULL);
+
+    if (!wfc->_dirty)
+        return 0;
+
+    if (WFC__BuildAdjacency(wfc) || WFC__BuildComposites(wfc))
+        return 1;
+
+    if (WFC__BuildGroups(wfc))
+        return 1;
+
+    if (WFC__BuildLimits(wfc))
+        return 1;
+
+    if (WFC__BuildConnectivity(wfc))
+        return 1;
+
+    // Grow the propagation queue so that it fits every cell
+    if (wfc->_propCap < wfc->cellCount)
+    {
+        int* new_queue = WFC_MALLOC(wfc->cellCount * sizeof new_queue[0]);
+        bool* new_flags = WFC_CALLOC(wfc->cellCount, sizeof new_flags[0]);
+        if (new_queue == NULL || new_flags == NULL)
+        {
+            WFC_FREE(new_queue);
+            WFC_FREE(new_flags);
+            return 1;
+        }
+
+        // Keep whatever is queued, unwrapping the ring buffer
+        for (int q = 0; q < wfc->propCount; q++)
+        {
+            new_queue[q] = wfc->_propQueue[(wfc->_propHead + q) % wfc->_propCap];
+            new_flags[new_queue[q]] = true;
+        }
+
+        WFC_FREE(wfc->_propQueue);
+        WFC_FREE(wfc->_inPropQueue);
+        wfc->_propQueue = new_queue;
+        wfc->_inPropQueue = new_flags;
+        wfc->_propHead = 0;
+        wfc->_propCap = wfc->cellCount;
+    }
+
+    // Grow the observation heap and the trail levels, then refill the heap since cells may have been added
+    if (wfc->_heapCap < wfc->cellCount)
+    {
+        WFC_FREE(wfc->_heap);
+        WFC_FREE(wfc->_heapPos);
+        WFC_FREE(wfc->_savedLevel);
+        wfc->_heap = WFC_MALLOC(wfc->cellCount * sizeof wfc->_heap[0]);
+        wfc->_heapPos = WFC_MALLOC(wfc->cellCount * sizeof wfc->_heapPos[0]);
+        wfc->_savedLevel = WFC_MALLOC(wfc->cellCount * sizeof wfc->_savedLevel[0]);
+        if (wfc->_heap == NULL || wfc->_heapPos == NULL || wfc->_savedLevel == NULL)
+        {
+            WFC_FREE(wfc->_heap);
+            WFC_FREE(wfc->_heapPos);
+            WFC_FREE(wfc->_savedLevel);
+            wfc->_heap = wfc->_heapPos = wfc->_savedLevel = NULL;
+            wfc->_heapCap = 0;
+            return 1;
+        }
+        wfc->_heapCap = wfc->cellCount;
+
+        // The trail can't be trusted across cells being added, so start a new search
+        wfc->_decisionCount = wfc->_trailCount = 0;
+        memset(wfc->_savedLevel, 0xFF, wfc->cellCount * sizeof wfc->_savedLevel[0]);
+    }
+    WFC__BuildHeap(wfc);
+
+    wfc->_dirty = false;
+    WFC__FreeSnapshot(wfc);
+
+    // Both engines read the compiled tables
+    if (WFC__CompileOwnRules(wfc) || (wfc->engine == WFC_ENGINE_AC4 && WFC__SetupSupports(wfc)))
+    {
+        wfc->_dirty = true;
+        return 1;
+    }
+
+    // Group rules and tile limits may have queued work, which has to be done before the next observation
+    // so that backtracking never undoes it
+    while (WFC__PropsLeft(wfc))
+    {
+        WFC__Propagate(wfc);
+    }
+
+    return 0;
+}
+
+// Changes a rule of a state initialized with WFC_Init. Shared rules are changed with WFC_DefineRule.
+void WFC_SetRule(WFC_State* wfc, Tile sTile, Tile dTile, int rel, bool allowed)
+{
+    assert(wfc != NULL && wfc->initialized);
+    assert(wfc->_ownedRules != NULL);
+
+    WFC_DefineRule(wfc->_ownedRules, sTile, dTile, rel, allowed);
+
+    // The AC-4 tables are derived from the propagator
+    wfc->_dirty = true;
+}
+
+// Declares the inverse of a relationship for a state initialized with WFC_Init, see WFC_DefineInverse.
+// Must be called before the edges of either relationship are added.
+void WFC_SetInverse(WFC_State* wfc, int rel, int inverse)
+{
+    assert(wfc != NULL && wfc->initialized);
+    assert(wfc->_ownedRules != NULL);
+
+    WFC_DefineInverse(wfc->_ownedRules, rel, inverse);
+    wfc->_dirty = true;
+}
+
+void WFC_SetPropagationOrder(WFC_State* wfc, WFC_PropOrder order)
+{
+    assert(wfc != NULL && wfc->initialized);
+    wfc->propOrder = order;
+}
+
+void WFC_SetEngine(WFC_State* wfc, WFC_Engine engine)
+{
+    assert(wfc != NULL && wfc->initialized);
+
+    if (wfc->engine == engine)
+        return;
+
+    // Shared rules can't be compiled from here
+    assert(engine != WFC_ENGINE_AC4 || wfc->_ownedRules != NULL || wfc->rules->compiled);
+
+    wfc->engine = engine;
+    if (engine != WFC_ENGINE_AC4)
+        WFC__FreeSupports(wfc);
+    wfc->_dirty = true;
+}
+
+//------------------------------------------------------------------------------------------
+// AC-4 engine
+//------------------------------------------------------------------------------------------
+
+// Support counts of an edge. Edges in the rows come after the grid edges.
+static inline int* WFC__Supports(WFC_State* wfc, int edge)
+{
+    return &wfc->_supports[(size_t) edge * wfc->tileCount];
+}
+
+// Removes a tile from a cell and queues the withdrawal of its supports.
+// Returns 1 if the cell was left without any valid tiles.
+static int WFC__Ban(WFC_State* wfc, int cellIdx, int tile)
+{
+    WFC_CellState* cell = &wfc->_cells[cellIdx];
+    WFC__Save(wfc, cellIdx);
+
+    if (wfc->_banCount == wfc->_banCap)
+    {
+        int newCap = wfc->_banCap > 0 ? wfc->_banCap * 2 : alloc_inc;
+        WFC_Ban* new_ptr = WFC_REALLOC(wfc->_bans, newCap * sizeof wfc->_bans[0]);
+        if (new_ptr == NULL)
+            return 1;
+
+        wfc->_bans = new_ptr;
+        wfc->_banCap = newCap;
+    }
+    wfc->_bans[wfc->_banCount++] = (WFC_Ban) { cellIdx, tile };
+
+    uint64_t* validTiles = WFC__Domain(wfc, cellIdx);
+    validTiles[tile >> 6] &= ~(1ULL << (tile & 63));
+    cell->validTileCount--;
+    cell->sumWeights -= wfc->tileset[tile].weight;
+    cell->weightLogWeightSum -= wfc->tileset[tile].weight * log(wfc->tileset[tile].weight);
+    WFC__TouchGroups(wfc, cellIdx);
+    WFC__TouchConnectivity(wfc, cellIdx, true);
+    WFC__LimitRemoved(wfc, cellIdx, tile);
+
+    if (cell->validTileCount == 0)
+        return 1;
+
+    if (cell->validTileCount == 1)
+    {
+        cell->isCollapsed = true;
+        for (int w = 0; w < wfc->tileWords; w++)
+        {
+            if (validTiles[w] != 0)
+            {
+                cell->collapsedTile = w * 64 + WFC__CTZ64(validTiles[w]);
+                break;
+            }
+        }
+        WFC__GroupCollapsed(wfc, cellIdx, cell->collapsedTile);
+        WFC__LimitCollapsed(wfc, cellIdx, cell->collapsedTile);
+    }
+
+    WFC__UpdateEntropy(wfc, cellIdx);
+    return 0;
+}
+
+static bool WFC__UnionComplement(const WFC_State* wfc, const WFC_Rules* rules, int rel, int srcCount, const uint64_t* srcTiles, const uint64_t* destTiles, uint64_t* allowed);
+
+// Bans the tiles at the destination that every tile left at the source forbids. Used instead of support
+// counts for complement relationships, whose few forbidden pairs would cost a withdrawal from almost every tile.
+// Returns 1 on a contradiction.
+static int WFC__BanComplement(WFC_State* wfc, const WFC_Rules* rules, int rel, int src, int dest)
+{
+    const int srcCount = wfc->_cells[src].validTileCount;
+    uint64_t* allowed = wfc->_rowScratch;
+    uint64_t* destTiles = WFC__Domain(wfc, dest);
+    if (srcCount == 0 || WFC__UnionComplement(wfc, rules, rel, srcCount, WFC__Domain(wfc, src), destTiles, allowed))
+        return 0;
+
+    for (int w = 0; w < wfc->tileWords; w++)
+    {
+        for (uint64_t removed = destTiles[w] & ~allowed[w]; removed != 0; removed &= removed - 1)
+        {
+            if (WFC__Ban(wfc, dest, w * 64 + WFC__CTZ64(removed)))
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Sets an edge's support counts from the domain of its source.
+// Trivial and complement relationships keep no counts.
+static void WFC__CountSupports(WFC_State* wfc, int cellIdx, int edge, int rel)
+{
+    const int tileCount = wfc->tileCount;
+    const WFC_Rules* rules = WFC__RelRules(wfc, &rel);
+    int* supports = WFC__Supports(wfc, edge);
+
+    if (rules->relKinds[rel] == WFC_REL_TRIVIAL || rules->relKinds[rel] == WFC_REL_COMPLEMENT)
+        return;
+
+    if (wfc->_cells[cellIdx].validTileCount == tileCount)
+    {
+        memcpy(supports, &rules->fullSupports[rel * tileCount], tileCount * sizeof supports[0]);
+        return;
+    }
+
+    memset(supports, 0, tileCount * sizeof supports[0]);
+    for (int w = 0; w < wfc->tileWords; w++)
+    {
+        for (uint64_t bits = WFC__Domain(wfc, cellIdx)[w]; bits != 0; bits &= bits - 1)
+        {
+            int compatIdx = rel * tileCount + w * 64 + WFC__CTZ64(bits);
+            for (int c = rules->compatOffsets[compatIdx]; c < rules->compatOffsets[compatIdx + 1]; c++)
+                supports[rules->compat[c]]++;
+        }
+    }
+}
+
+// Bans the tiles of an edge's destination that are left without support. Returns 1 on a contradiction.
+static int WFC__BanUnsupported(WFC_State* wfc, int cellIdx, int edge, int dest, int rel)
+{
+    const WFC_Rules* rules = WFC__RelRules(wfc, &rel);
+    if (rules->relKinds[rel] == WFC_REL_TRIVIAL)
+        return 0;
+    if (rules->relKinds[rel] == WFC_REL_COMPLEMENT)
+        return WFC__BanComplement(wfc, rules, rel, cellIdx, dest);
+
+    const int* supports = WFC__Supports(wfc, edge);
+    for (int t = 0; t < wfc->tileCount; t++)
+    {
+        if (supports[t] == 0 && WFC_IsTileValid(wfc, dest, t) && WFC__Ban(wfc, dest, t))
+            return 1;
+    }
+
+    return 0;
+}
+
+// Sets every edge's support counts from the current domains, then bans the tiles left without support.
+// Returns 1 on a contradiction.
+static int WFC__InitSupports(WFC_State* wfc)
+{
+    const int gridEdges = wfc->_gridCells * wfc->_gridDirs;
+    int gridNeighbors[6];
+    wfc->_banCount = 0;
+
+    for (int i = 0; i < wfc->cellCount; i++)
+    {
+        for (int d = WFC__GridNeighbors(wfc, i, gridNeighbors) - 1; d >= 0; d--)
+        {
+            if (gridNeighbors[d] >= 0)
+                WFC__CountSupports(wfc, i, i * wfc->_gridDirs + d, wfc->_grid.rels[d]);
+        }
+
+        for (int e = wfc->_adjOffsets[i]; e < wfc->_adjOffsets[i + 1]; e++)
+            WFC__CountSupports(wfc, i, gridEdges + e, wfc->_adjRel[e]);
+    }
+
+    for (int i = 0; i < wfc->cellCount; i++)
+    {
+        for (int d = WFC__GridNeighbors(wfc, i, gridNeighbors) - 1; d >= 0; d--)
+        {
+            if (gridNeighbors[d] >= 0 && WFC__BanUnsupported(wfc, i, i * wfc->_gridDirs + d, gridNeighbors[d], wfc->_grid.rels[d]))
+                return 1;
+        }
+
+        for (int e = wfc->_adjOffsets[i]; e < wfc->_adjOffsets[i + 1]; e++)
+        {
+            if (WFC__BanUnsupported(wfc, i, gridEdges + e, wfc->_adjIdx[e], wfc->_adjRel[e]))
+                return 1;
+        }
+    }
+
+    while (wfc->_banCount > 0 || WFC__GlobalPropsLeft(wfc))
+    {
+        if (WFC__Propagate(wfc))
+            return 1;
+    }
+
+    return 0;
+}
+
+// Compiles the rules the state owns and its composites, if they changed since they were last compiled
+static int WFC__CompileOwnRules(WFC_State* wfc)
+{
+    if (wfc->_ownedRules != NULL && !wfc->_ownedRules->compiled && WFC_CompileRules(wfc->_ownedRules))
+        return 1;
+    if (wfc->_composites.initialized && !wfc->_composites.compiled && WFC_CompileRules(&wfc->_composites))
+        return 1;
+
+    return 0;
+}
+
+// Allocates the support counts of every edge and fills them in.
+static int WFC__SetupSupports(WFC_State* wfc)
+{
+    WFC__FreeSupports(wfc);
+
+    if (WFC__CompileOwnRules(wfc))
+        return 1;
+
+    wfc->_supports = WFC_MALLOC(((size_t) WFC__EdgeTotal(wfc) * wfc->tileCount + 1) * sizeof wfc->_supports[0]);
+    if (wfc->_supports == NULL)
+        goto alloc_error;
+
+    WFC__InitSupports(wfc);
+    return 0;
+
+alloc_error:
+    WFC__FreeSupports(wfc);
+    return 1;
+}
+
+// Withdraws the supports a tile of "cellIdx" gave along one edge. If "ban" is set, the tiles that run out of support are banned.
+static int WFC__WithdrawEdge(WFC_State* wfc, int cellIdx, int edge, int dest, int rel, int tile, bool ban)
+{
+    int contradiction = 0;
+    const WFC_Rules* rules = WFC__RelRules(wfc, &rel);
+    int compatIdx = rel * wfc->tileCount + tile;
+    int* supports = WFC__Supports(wfc, edge);
+
+    if (rules->relKinds[rel] == WFC_REL_TRIVIAL)
+        return 0;
+    // The banned tile is already gone from the source, so complement relationships check against what's left
+    if (rules->relKinds[rel] == WFC_REL_COMPLEMENT)
+        return ban ? WFC__BanComplement(wfc, rules, rel, cellIdx, dest) : 0;
+
+    for (int c = rules->compatOffsets[compatIdx]; c < rules->compatOffsets[compatIdx + 1]; c++)
+    {
+        int t = rules->compat[c];
+        if (--supports[t] == 0 && ban && !contradiction && WFC_IsTileValid(wfc, dest, t))
+            contradiction = WFC__Ban(wfc, dest, t);
+    }
+
+    return contradiction;
+}
+
+// Withdraws the supports of a banned tile. If "ban" is set, the tiles that run out of support are banned.
+// All supports are withdrawn even after a contradiction, so that they can be restored when backtracking.
+static int WFC__WithdrawSupports(WFC_State* wfc, int cellIdx, int tile, bool ban)
+{
+    const int gridEdges = wfc->_gridCells * wfc->_gridDirs;
+    int gridNeighbors[6];
+    int contradiction = 0;
+
+    WFC_DEBUG_PRINTF("Withdrawing supports of tile %d at %d.\n", tile, cellIdx);
+
+    int dirs = WFC__GridNeighbors(wfc, cellIdx, gridNeighbors);
+    for (int d = 0; d < dirs; d++)
+    {
+        if (gridNeighbors[d] >= 0 && WFC__WithdrawEdge(wfc, cellIdx, cellIdx * dirs + d, gridNeighbors[d], wfc->_grid.rels[d], tile, ban && !contradiction))
+            contradiction = 1;
+    }
+
+    for (int e = wfc->_adjOffsets[cellIdx]; e < wfc->_adjOffsets[cellIdx + 1]; e++)
+    {
+        if (WFC__WithdrawEdge(wfc, cellIdx, gridEdges + e, wfc->_adjIdx[e], wfc->_adjRel[e], tile, ban && !contradiction))
+            contradiction = 1;
+    }
+
+    return contradiction;
+}
+
+// Gives back the supports a tile gives along one edge
+static inline void WFC__RestoreEdge(WFC_State* wfc, int edge, int rel, int tile)
+{
+    const WFC_Rules* rules = WFC__RelRules(wfc, &rel);
+    int compatIdx = rel * wfc->tileCount + tile;
+    int* supports = WFC__Supports(wfc, edge);
+
+    if (rules->relKinds[rel] == WFC_REL_TRIVIAL || rules->relKinds[rel] == WFC_REL_COMPLEMENT)
+        return;
+
+    for (int c = rules->compatOffsets[compatIdx]; c < rules->compatOffsets[compatIdx + 1]; c++)
+        supports[rules->compat[c]]++;
+}
+
+// Gives back the supports of a tile that is valid again after backtracking.
+static void WFC__RestoreSupports(WFC_State* wfc, int cellIdx, int tile)
+{
+    const int gridEdges = wfc->_gridCells * wfc->_gridDirs;
+    int gridNeighbors[6];
+
+    int dirs = WFC__GridNeighbors(wfc, cellIdx, gridNeighbors);
+    for (int d = 0; d < dirs; d++)
+    {
+        if (gridNeighbors[d] >= 0)
+            WFC__RestoreEdge(wfc, cellIdx * dirs + d, wfc->_grid.rels[d], tile);
+    }
+
+    for (int e = wfc->_adjOffsets[cellIdx]; e < wfc->_adjOffsets[cellIdx + 1]; e++)
+        WFC__RestoreEdge(wfc, gridEdges + e, wfc->_adjRel[e], tile);
+}
+
+static int WFC__PropagateSupport(WFC_State* wfc)
+{
+    WFC_Ban b = wfc->_bans[--wfc->_banCount];
+    return WFC__WithdrawSupports(wfc, b.cell, b.tile, true);
+}
+
+// Queues a cell whose domain changed, unless it's already waiting.
+static inline void WFC__AddProp(WFC_State* wfc, int cellIdx)
+{
+    if (wfc->_inPropQueue[cellIdx])
+        return;
+
+    wfc->_inPropQueue[cellIdx] = true;
+    wfc->_propQueue[(wfc->_propHead + wfc->propCount) % wfc->_propCap] = cellIdx;
+    wfc->propCount++;
+}
+
+static inline int WFC__PopProp(WFC_State* wfc)
+{
+    int cellIdx;
+    if (wfc->propOrder == WFC_PROP_FIFO)
+    {
+        cellIdx = wfc->_propQueue[wfc->_propHead];
+        wfc->_propHead = (wfc->_propHead + 1) % wfc->_propCap;
+    }
+    else
+    {
+        cellIdx = wfc->_propQueue[(wfc->_propHead + wfc->propCount - 1) % wfc->_propCap];
+    }
+
+    wfc->propCount--;
+    wfc->_inPropQueue[cellIdx] = false;
+    return cellIdx;
+}
+
+static inline void WFC__SetCollapsed(WFC_State* wfc, int cellIdx, int toTile)
+{
+    WFC_CellState* cellToCollapse = &wfc->_cells[cellIdx];
+
+    if (wfc->engine == WFC_ENGINE_AC4)
+    {
+        // Ban every other tile. Their supports are withdrawn during propagation.
+        for (int w = 0; w < wfc->tileWords; w++)
+        {
+            for (uint64_t bits = WFC__Domain(wfc, cellIdx)[w]; bits != 0; bits &= bits - 1)
+            {
+                int t = w * 64 + WFC__CTZ64(bits);
+                if (t != toTile)
+                    WFC__Ban(wfc, cellIdx, t);
+            }
+        }
+        cellToCollapse->isCollapsed = true;
+        cellToCollapse->collapsedTile = toTile;
+        WFC__HeapRemove(wfc, cellIdx);
+        return;
+    }
+
+    WFC__Save(wfc, cellIdx);
+
+    // Set valid cell and weights for collapsed cell
+    uint64_t* validTiles = WFC__Domain(wfc, cellIdx);
+    if (wfc->_limitOffsets != NULL)
+    {
+        for (int w = 0; w < wfc->tileWords; w++)
+        {
+            for (uint64_t bits = validTiles[w]; bits != 0; bits &= bits - 1)
+            {
+                int t = w * 64 + WFC__CTZ64(bits);
+                if (t != toTile)
+                    WFC__LimitRemoved(wfc, cellIdx, t);
+            }
+        }
+    }
+    memset(validTiles, 0, wfc->tileWords * sizeof validTiles[0]);
+    validTiles[toTile >> 6] = 1ULL << (toTile & 63);
+    cellToCollapse->isCollapsed = true;
+    cellToCollapse->collapsedTile = toTile;
+    cellToCollapse->validTileCount = 1;
+    cellToCollapse->sumWeights = 0;
+
+    WFC__HeapRemove(wfc, cellIdx);
+    WFC__AddProp(wfc, cellIdx);
+    WFC__TouchGroups(wfc, cellIdx);
+    WFC__TouchConnectivity(wfc, cellIdx, true);
+    WFC__GroupCollapsed(wfc, cellIdx, toTile);
+    WFC__LimitCollapsed(wfc, cellIdx, toTile);
+}
+
+void WFC_SetTileTo(WFC_State* wfc, int cellIdx, int tile)
+{
+    assert(wfc != NULL && wfc->initialized);
+    assert(cellIdx >= 0 && cellIdx < wfc->cellCount);
+
+    // In case the state is dirty.
+    if (WFC__RefitState(wfc))
+        return;
+
+    if (wfc->_cells[cellIdx].isCollapsed)
+        return;
+
+    // A new initial tile changes what resets start from
+    if (wfc->_initialTile[cellIdx] != tile)
+        WFC__FreeSnapshot(wfc);
+
+    wfc->_initialTile[cellIdx] = tile;
+    WFC__SetCollapsed(wfc, cellIdx, tile);
+
+    while (WFC__PropsLeft(wfc))
+    {
+        WFC__Propagate(wfc);
+    }
+}
+
+static int WFC__RemoveTile(WFC_State* wfc, int cellIdx, int tile);
+
+// Removes the tiles of a cell that aren't in "mask", without propagating. Returns 1 on a contradiction.
+static int WFC__ApplyMask(WFC_State* wfc, int cellIdx, const uint64_t* mask)
+{
+    for (int w = 0; w < wfc->tileWords; w++)
+    {
+        for (uint64_t bits = WFC__Domain(wfc, cellIdx)[w] & ~mask[w]; bits != 0; bits &= bits - 1)
+        {
+            if (WFC__RemoveTile(wfc, cellIdx, w * 64 + WFC__CTZ64(bits)))
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Applies the initial masks and tiles of every cell, leaving the propagation to the caller so that it's done once
+static void WFC__ApplyInitial(WFC_State* wfc)
+{
+    bool refitted = false;
+    for (int i = 0; i < wfc->cellCount; i++)
+    {
+        if (wfc->_initialTile[i] < 0 && wfc->_initialMasks == NULL)
+            continue;
+
+        // Changing cells needs the state refitted, which WFC_SetTileTo used to do for each initial tile
+        if (!refitted)
+        {
+            if (WFC__RefitState(wfc))
+                return;
+            refitted = true;
+        }
+
+        if (wfc->_initialMasks != NULL && WFC__ApplyMask(wfc, i, &wfc->_initialMasks[(size_t) i * wfc->tileWords]))
+            continue;
+        if (wfc->_initialTile[i] > -1 && !wfc->_cells[i].isCollapsed)
+            WFC__SetCollapsed(wfc, i, wfc->_initialTile[i]);
+    }
+}
+
+// Collapses each cell in "cells" to the tile at the same index in "tiles", like WFC_SetTileTo,
+// but propagates once for all of them. Returns 1 if the state couldn't be refitted.
+int WFC_SetTilesTo(WFC_State* wfc, const int* cells, const int* tiles, int count)
+{
+    assert(wfc != NULL && wfc->initialized);
+    assert((cells != NULL && tiles != NULL) || count == 0);
+
+    if (WFC__RefitState(wfc))
+        return 1;
+
+    for (int i = 0; i < count; i++)
+    {
+        assert(cells[i] >= 0 && cells[i] < wfc->cellCount);
+        assert(tiles[i] >= 0 && tiles[i] < wfc->tileCount);
+
+        if (wfc->_cells[cells[i]].isCollapsed)
+            continue;
+
+        if (wfc->_initialTile[cells[i]] != tiles[i])
+            WFC__FreeSnapshot(wfc);
+
+        wfc->_initialTile[cells[i]] = tiles[i];
+        WFC__SetCollapsed(wfc, cells[i], tiles[i]);
+    }
+
+    while (WFC__PropsLeft(wfc))
+    {
+        WFC__Propagate(wfc);
+    }
+
+    return 0;
+}
+
+// Restricts each cell in "cells" to the tiles set in a mask, then propagates once for all of them.
+// A mask is tileWords words with bit (t & 63) of word (t >> 6) set for each allowed tile t. "masks" holds
+// one mask per cell if "perCell" is set, otherwise a single mask for every cell, e.g. "any water tile".
+// Restrictions add up, and are applied again on every reset. Returns 1 if there was an allocation error.
+int WFC_RestrictCells(WFC_State* wfc, const int* cells, int count, const uint64_t* masks, bool perCell)
+{
+    assert(wfc != NULL && wfc->initialized);
+    assert((cells != NULL && masks != NULL) || count == 0);
+
+    if (WFC__RefitState(wfc))
+        return 1;
+
+    if (wfc->_initialMasks == NULL && count > 0)
+    {
+        wfc->_initialMasks = WFC_MALLOC((size_t) wfc->_cellCap * wfc->tileWords * sizeof wfc->_initialMasks[0]);
+        if (wfc->_initialMasks == NULL)
+            return 1;
+        for (int i = 0; i < wfc->cellCount; i++)
+            WFC__BitsetFill(&wfc->_initialMasks[(size_t) i * wfc->tileWords], wfc->tileWords, wfc->tileCount);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        assert(cells[i] >= 0 && cells[i] < wfc->cellCount);
+
+        const uint64_t* mask = perCell ? &masks[(size_t) i * wfc->tileWords] : masks;
+        uint64_t* initialMask = &wfc->_initialMasks[(size_t) cells[i] * wfc->tileWords];
+        for (int w = 0; w < wfc->tileWords; w++)
+        {
+            // A new restriction changes what resets start from
+            if (initialMask[w] & ~mask[w])
+                WFC__FreeSnapshot(wfc);
+            initialMask[w] &= mask[w];
+        }
+
+        WFC__ApplyMask(wfc, cells[i], mask);
+    }
+
+    while (WFC__PropsLeft(wfc))
+    {
+        WFC__Propagate(wfc);
+    }
+
+    return 0;
+}
+
+int WFC__Collapse(WFC_State* wfc, int cellIdx)
+{
+    float choice = (float) WFC__RandomDouble(wfc) * wfc->_cells[cellIdx].sumWeights;
+    int chosenTile = -1;
+    int lastValid = -1;
+    const uint64_t* validTiles = WFC__Domain(wfc, cellIdx);
+    for (int w = 0; w < wfc->tileWords && chosenTile == -1; w++)
+    {
+        for (uint64_t bits = validTiles[w]; bits != 0; bits &= bits - 1)
+        {
+            int i = w * 64 + WFC__CTZ64(bits);
+            lastValid = wfc->tileset[i].val;
+            float weight = wfc->tileset[i].weight;
+            if (choice >= weight)
+            {
+                choice -= weight;
+            }
+            else
+            {
+                chosenTile = wfc->tileset[i].val;
+                break;
+            }
+        }
+    }
+
+    // Rounding errors in the weight sum can leave the choice past the last tile
+    if (chosenTile == -1)
+        chosenTile = lastValid;
+
+    if (chosenTile == -1)
+        return -1;
+
+    WFC__SetCollapsed(wfc, cellIdx, chosenTile);
+    return chosenTile;
+}
+
+// FIXME: doesn't seem to work when a cell has a known (0 valid elements). Test in the sudoku!
+int WFC__Observe(WFC_State* wfc)
+{
+    // The cell with minimum entropy is at the top of the heap
+    if (wfc->_heapCount == 0)
+        return -1;
+
+    int arg_min = wfc->_heap[0];
+
+    // Open a new decision level, so that the collapse can be undone
+    if (wfc->_decisionCount == wfc->_decisionCap)
+    {
+        int newCap = wfc->_decisionCap > 0 ? wfc->_decisionCap * 2 : alloc_inc;
+        WFC_Decision* new_ptr = WFC_REALLOC(wfc->_decisions, newCap * sizeof wfc->_decisions[0]);
+        if (new_ptr == NULL)
+            wfc->_trailFailed = true;
+        else
+        {
+            wfc->_decisions = new_ptr;
+            wfc->_decisionCap = newCap;
+        }
+    }
+
+    if (wfc->_decisionCount < wfc->_decisionCap)
+    {
+        WFC_Decision* decision = &wfc->_decisions[wfc->_decisionCount++];
+        decision->cell = arg_min;
+        decision->trailStart = wfc->_trailCount;
+        decision->tile = WFC__Collapse(wfc, arg_min);
+    }
+    else
+    {
+        WFC__Collapse(wfc, arg_min);
+    }
+#ifdef WFC_METRICS 
+    wfc->totalObservations += 1;
+#endif
+
+    return arg_min;
+}
+
+// Union of the rows of every tile still possible at the source.
+// Stops early once every tile at the destination is supported, returning true.
+static bool WFC__UnionRows(const WFC_State* wfc, const WFC_Rules* rules, int rel, const uint64_t* srcTiles, const uint64_t* destTiles, uint64_t* allowed)
+{
+    const int words = wfc->tileWords;
+    memset(allowed, 0, words * sizeof allowed[0]);
+
+    for (int w = 0; w < words; w++)
+    {
+        for (uint64_t bits = srcTiles[w]; bits != 0; bits &= bits - 1)
+        {
+            const uint64_t* row = WFC__RulesRow(rules, rel, w * 64 + WFC__CTZ64(bits));
+            uint64_t missing = 0;
+            for (int dw = 0; dw < words; dw++)
+            {
+                allowed[dw] |= row[dw];
+                missing |= destTiles[dw] & ~allowed[dw];
+            }
+
+            if (missing == 0)
+                return true;
+        }
+    }
+
+    return false;
+}
+
+// Union of the compatible tile lists of every tile still possible at the source.
+// Returns true if every tile at the destination is supported.
+static bool WFC__UnionCompat(const WFC_State* wfc, const WFC_Rules* rules, int rel, const uint64_t* srcTiles, const uint64_t* destTiles, uint64_t* allowed)
+{
+    const int words = wfc->tileWords;
+    memset(allowed, 0, words * sizeof allowed[0]);
+
+    for (int w = 0; w < words; w++)
+    {
+        for (uint64_t bits = srcTiles[w]; bits != 0; bits &= bits - 1)
+        {
+            int compatIdx = rel * wfc->tileCount + w * 64 + WFC__CTZ64(bits);
+            for (int c = rules->compatOffsets[compatIdx]; c < rules->compatOffsets[compatIdx + 1]; c++)
+                allowed[rules->compat[c] >> 6] |= 1ULL << (rules->compat[c] & 63);
+        }
+    }
+
+    uint64_t missing = 0;
+    for (int w = 0; w < words; w++)
+        missing |= destTiles[w] & ~allowed[w];
+    return missing == 0;
+}
+
+// Allows every tile at the destination except the ones banned by all "srcCount" tiles left at the source.
+// A tile banned by fewer source tiles than that keeps its support, so large sources are skipped right away.
+// Returns true if every tile at the destination is supported.
+static bool WFC__UnionComplement(const WFC_State* wfc, const WFC_Rules* rules, int rel, int srcCount, const uint64_t* srcTiles, const uint64_t* destTiles, uint64_t* allowed)
+{
+    if (srcCount > rules->maxBanned[rel])
+        return true;
+
+    const int words = wfc->tileWords;
+    memcpy(allowed, destTiles, words * sizeof allowed[0]);
+
+    bool covered = true;
+    for (int w = 0; w < words; w++)
+    {
+        for (uint64_t bits = destTiles[w]; bits != 0; bits &= bits - 1)
+        {
+            int bannedIdx = rel * wfc->tileCount + w * 64 + WFC__CTZ64(bits);
+            int begin = rules->bannedOffsets[bannedIdx], end = rules->bannedOffsets[bannedIdx + 1];
+            if (end - begin < srcCount)
+                continue;
+
+            int banning = 0;
+            for (int b = begin; b < end; b++)
+                banning += srcTiles[rules->banned[b] >> 6] >> (rules->banned[b] & 63) & 1;
+
+            if (banning == srcCount)
+            {
+                allowed[w] &= ~(bits & -bits);
+                covered = false;
+            }
+        }
+    }
+
+    return covered;
+}
+
+// Removes the tiles at the destination that no tile left at the source allows.
+// Returns 1 if the destination was left without any valid tiles.
+static int WFC__Revise(WFC_State* wfc, int from, int to, int rel)
+{
+    WFC_CellState* destCell = &wfc->_cells[to];
+
+    WFC_DEBUG_PRINTF("Propagating %d -> %d... ", from, to);
+
+    const int words = wfc->tileWords;
+    uint64_t* allowed = wfc->_rowScratch;
+    uint64_t* destTiles = WFC__Domain(wfc, to);
+    const uint64_t* srcTiles = WFC__Domain(wfc, from);
+
+    // Rules that weren't compiled are always read as rows
+    const WFC_Rules* rules = WFC__RelRules(wfc, &rel);
+    WFC_RelKind kind = rules->compiled ? rules->relKinds[rel] : WFC_REL_DENSE;
+
+    bool covered;
+    if (kind == WFC_REL_SPARSE)
+        covered = WFC__UnionCompat(wfc, rules, rel, srcTiles, destTiles, allowed);
+    else if (kind == WFC_REL_COMPLEMENT)
+        covered = WFC__UnionComplement(wfc, rules, rel, wfc->_cells[from].validTileCount, srcTiles, destTiles, allowed);
+    else
+        covered = WFC__UnionRows(wfc, rules, rel, srcTiles, destTiles, allowed);
+
+    if (covered)
+    {
+        WFC_DEBUG_PRINT("No changes.\n");
+        return 0;
+    }
+
+    WFC__Save(wfc, to);
+
+    int newValidCount = 0;
+    float newSumWeights = destCell->sumWeights;
+    float newSumLogWeights = destCell->weightLogWeightSum;
+    int lastEnabled = -1;
+
+    for (int w = 0; w < words; w++)
+    {
+        for (uint64_t removed = destTiles[w] & ~allowed[w]; removed != 0; removed &= removed - 1)
+        {
+            int destTileIdx = w * 64 + WFC__CTZ64(removed);
+            newSumWeights -= wfc->tileset[destTileIdx].weight;
+            newSumLogWeights -= wfc->tileset[destTileIdx].weight * log(wfc->tileset[destTileIdx].weight);
+            WFC__LimitRemoved(wfc, to, destTileIdx);
+        }
+
+        destTiles[w] &= allowed[w];
+        newValidCount += WFC__POPCOUNT64(destTiles[w]);
+        if (destTiles[w] != 0)
+            lastEnabled = w * 64 + WFC__CTZ64(destTiles[w]);
+    }
+
+    if (newValidCount == 0)
+        return 1;
+
+    WFC_DEBUG_PRINTF("Changed valid tiles from %d to %d.\n", destCell->validTileCount, newValidCount);
+
+    destCell->validTileCount = newValidCount;
+    destCell->sumWeights = newSumWeights;
+    destCell->weightLogWeightSum = newSumLogWeights;
+    WFC__TouchGroups(wfc, to);
+    WFC__TouchConnectivity(wfc, to, true);
+
+    if (destCell->validTileCount == 1)
+    {
+        WFC__SetCollapsed(wfc, to, lastEnabled);
+    }
+    else
+    {
+        WFC__UpdateEntropy(wfc, to);
+        WFC__AddProp(wfc, to);
+    }
+
+    return 0;
+}
+
+static int WFC__PropagateGroups(WFC_State* wfc);
+static int WFC__PropagateLimits(WFC_State* wfc);
+static int WFC__PropagateConnectivity(WFC_State* wfc);
+
+int WFC__Propagate(WFC_State* wfc)
+{
+    // Tile limits that reached a bound ban or place their tile in bulk
+    if (wfc->_limitQueueCount > 0)
+    {
+#ifdef WFC_METRICS
+        wfc->totalPropagations += 1;
+#endif
+        return WFC__PropagateLimits(wfc);
+    }
+
+    // Group events first, they ban tiles in bulk. AllDifferent checks wait until the engine is done,
+    // since they look at the whole group.
+    if (wfc->_groupEventCount > 0 || (wfc->_groupQueueCount > 0 && !WFC__EnginePropsLeft(wfc)))
+    {
+#ifdef WFC_METRICS
+        wfc->totalPropagations += 1;
+#endif
+        return WFC__PropagateGroups(wfc);
+    }
+
+    // Connectivity checks walk the whole wave, so they also wait for the engine
+    if (wfc->_connQueueCount > 0 && !WFC__EnginePropsLeft(wfc))
+    {
+#ifdef WFC_METRICS
+        wfc->totalPropagations += 1;
+#endif
+        return WFC__PropagateConnectivity(wfc);
+    }
+
+    if (wfc->engine == WFC_ENGINE_AC4)
+    {
+#ifdef WFC_METRICS
+        wfc->totalPropagations += 1;
+#endif
+        return WFC__PropagateSupport(wfc);
+    }
+
+    assert(wfc->propCount > 0);
+    int from = WFC__PopProp(wfc);
+
+    int gridNeighbors[6];
+    int dirs = WFC__GridNeighbors(wfc, from, gridNeighbors);
+    // Edges of relationships that allow every pair can't prune, so they're skipped
+    for (int d = 0; d < dirs; d++)
+    {
+        if (gridNeighbors[d] < 0 || WFC__RelKind(wfc, wfc->_grid.rels[d]) == WFC_REL_TRIVIAL)
+            continue;
+#ifdef WFC_METRICS
+        wfc->totalPropagations += 1;
+#endif
+        if (WFC__Revise(wfc, from, gridNeighbors[d], wfc->_grid.rels[d]))
+            return 1;
+    }
+
+    for (int e = wfc->_adjOffsets[from]; e < wfc->_adjOffsets[from + 1]; e++)
+    {
+        if (WFC__RelKind(wfc, wfc->_adjRel[e]) == WFC_REL_TRIVIAL)
+            continue;
+#ifdef WFC_METRICS
+        wfc->totalPropagations += 1;
+#endif
+        // Collapsed neighbors are revised too, so that conflicts with them are detected.
+        if (WFC__Revise(wfc, from, wfc->_adjIdx[e], wfc->_adjRel[e]))
+            return 1;
+    }
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------------------
+// Backtracking
+//------------------------------------------------------------------------------------------
+
+// Empties the propagation queues after a contradiction.
+static void WFC__ClearProps(WFC_State* wfc)
+{
+    while (wfc->propCount > 0)
+        WFC__PopProp(wfc);
+    WFC__ClearGroupQueues(wfc);
+    while (wfc->_limitQueueCount > 0)
+        wfc->_inLimitQueue[wfc->_limitQueue[--wfc->_limitQueueCount]] = false;
+    while (wfc->_connQueueCount > 0)
+        wfc->_inConnQueue[wfc->_connQueue[--wfc->_connQueueCount]] = false;
+
+    // Bans already removed their tile, so their supports still have to be withdrawn
+    while (wfc->_banCount > 0)
+    {
+        WFC_Ban b = wfc->_bans[--wfc->_banCount];
+        WFC__WithdrawSupports(wfc, b.cell, b.tile, false);
+    }
+}
+
+// Restores every cell saved since "trailStart".
+static void WFC__Undo(WFC_State* wfc, int trailStart)
+{
+    while (wfc->_trailCount > trailStart)
+    {
+        int t = --wfc->_trailCount;
+        const WFC_TrailEntry* entry = &wfc->_trail[t];
+        const uint64_t* savedTiles = &wfc->_trailTiles[(size_t) t * wfc->tileWords];
+        uint64_t* validTiles = WFC__Domain(wfc, entry->cell);
+
+        if (wfc->engine == WFC_ENGINE_AC4)
+        {
+            for (int w = 0; w < wfc->tileWords; w++)
+            {
+                for (uint64_t bits = savedTiles[w] & ~validTiles[w]; bits != 0; bits &= bits - 1)
+                    WFC__RestoreSupports(wfc, entry->cell, w * 64 + WFC__CTZ64(bits));
+            }
+        }
+
+        // Collapses are undone in the group counters too
+        const WFC_CellState* cell = &wfc->_cells[entry->cell];
+        if (cell->isCollapsed && !entry->state.isCollapsed && entry->cell < wfc->_groupRowCells)
+        {
+            for (int m = wfc->_cellGroupOffsets[entry->cell]; m < wfc->_cellGroupOffsets[entry->cell + 1]; m++)
+                wfc->_groupTileCounts[wfc->_cellGroups[m] * wfc->tileCount + cell->collapsedTile]--;
+        }
+        WFC__RestoreLimits(wfc, entry->cell, savedTiles, entry->state.isCollapsed);
+
+        memcpy(validTiles, savedTiles, wfc->tileWords * sizeof validTiles[0]);
+        wfc->_cells[entry->cell] = entry->state;
+        wfc->_savedLevel[entry->cell] = entry->prevLevel;
+        WFC__TouchConnectivity(wfc, entry->cell, false);
+
+        WFC__HeapRestore(wfc, entry->cell);
+    }
+}
+
+// Removes one tile from a cell and queues the change.
+// Returns 1 if the cell was left without any valid tiles.
+static int WFC__RemoveTile(WFC_State* wfc, int cellIdx, int tile)
+{
+    if (!WFC_IsTileValid(wfc, cellIdx, tile))
+        return 0;
+
+    if (wfc->engine == WFC_ENGINE_AC4)
+        return WFC__Ban(wfc, cellIdx, tile);
+
+    WFC_CellState* cell = &wfc->_cells[cellIdx];
+    uint64_t* validTiles = WFC__Domain(wfc, cellIdx);
+    WFC__Save(wfc, cellIdx);
+
+    validTiles[tile >> 6] &= ~(1ULL << (tile & 63));
+    cell->validTileCount--;
+    cell->sumWeights -= wfc->tileset[tile].weight;
+    cell->weightLogWeightSum -= wfc->tileset[tile].weight * log(wfc->tileset[tile].weight);
+    WFC__TouchGroups(wfc, cellIdx);
+    WFC__TouchConnectivity(wfc, cellIdx, true);
+    WFC__LimitRemoved(wfc, cellIdx, tile);
+
+    if (cell->validTileCount == 0)
+        return 1;
+
+    if (cell->validTileCount == 1)
+    {
+        for (int w = 0; w < wfc->tileWords; w++)
+        {
+            if (validTiles[w] != 0)
+            {
+                WFC__SetCollapsed(wfc, cellIdx, w * 64 + WFC__CTZ64(validTiles[w]));
+                break;
+            }
+        }
+        return 0;
+    }
+
+    WFC__UpdateEntropy(wfc, cellIdx);
+    WFC__AddProp(wfc, cellIdx);
+    return 0;
+}
+
+// Recovers from a contradiction by undoing the last observation and banning the tile it chose,
+// going further back for as long as that also leads to a contradiction.
+// Returns 1 if there's nothing left to undo, in which case the wave has to be reset.
+static int WFC__Backtrack(WFC_State* wfc)
+{
+    WFC__ClearProps(wfc);
+
+    while (wfc->_decisionCount > 0 && !wfc->_trailFailed)
+    {
+        if (wfc->backtrackLimit > 0 && wfc->_backtracks >= wfc->backtrackLimit)
+            return 1;
+
+        WFC_Decision decision = wfc->_decisions[--wfc->_decisionCount];
+        WFC__Undo(wfc, decision.trailStart);
+        wfc->_backtracks++;
+#ifdef WFC_METRICS
+        wfc->totalBacktracks += 1;
+#endif
+
+        WFC_DEBUG_PRINTF("Backtracking: banning tile %d at %d.\n", decision.tile, decision.cell);
+
+        int err = decision.tile < 0 ? 0 : WFC__RemoveTile(wfc, decision.cell, decision.tile);
+        while (!err && WFC__PropsLeft(wfc))
+            err = WFC__Propagate(wfc);
+
+        if (!err)
+            return 0;
+
+        WFC__ClearProps(wfc);
+    }
+
+    return 1;
+}
+
+// Handles a contradiction found while propagating.
+static void WFC__Contradiction(WFC_State* wfc)
+{
+    if (WFC__Backtrack(wfc))
+    {
+        WFC__Reset(wfc);
+#ifdef WFC_METRICS
+        wfc->totalResets += 1;
+#endif
+    }
+}
+
+int WFC_DoStep(WFC_State* wfc)
+{
+    assert(wfc != NULL && wfc->initialized);
+
+#ifdef WFC_METRICS
+    if (wfc->maxResets > 0 && wfc->totalResets >= wfc->maxResets)
+    {
+        return WFC_ERROR;
+    }
+#endif
+
+    if (WFC__RefitState(wfc))
+        return WFC_ERROR;
+
+    int collapsed = WFC__Observe(wfc);
+    if (collapsed < 0)
+    {
+        wfc->isFinished = true;
+        return WFC_SUCCESS;
+    }
+
+    while (WFC__PropsLeft(wfc))
+    {
+        int err = WFC__Propagate(wfc);
+        if (err)
+            WFC__Contradiction(wfc);
+    }
+
+#ifdef WFC_METRICS
+    wfc->totalIterations += 1;
+#endif
+
+    return 0;
+}
+
+// Whether another run of the same portfolio has already finished
+static inline bool WFC__Cancelled(const WFC_State* wfc)
+{
+#ifdef WFC_THREADS
+    return wfc->_cancel != NULL && atomic_load_explicit((atomic_int*) wfc->_cancel, memory_order_relaxed);
+#else
+    (void) wfc;
+    return false;
+#endif
+}
+
+int WFC_Run(WFC_State* wfc)
+{
+    assert(wfc != NULL && wfc->initialized);
+
+    if (WFC__RefitState(wfc))
+        return WFC_ERROR;
+
+    while (WFC__Observe(wfc) >= 0)
+    {
+        if (WFC__Cancelled(wfc))
+            return WFC_ERROR;
+
+        while (WFC__PropsLeft(wfc))
+        {
+            int err = WFC__Propagate(wfc);
+            if (err)
+                WFC__Contradiction(wfc);
+
+#ifdef WFC_METRICS
+            if (wfc->maxResets > 0 && wfc->totalResets >= wfc->maxResets)
+            {
+                return WFC_ERROR;
+            }
+#endif
+        }
+
+#ifdef WFC_METRICS 
+        wfc->totalIterations += 1;
+#endif
+    }
+
+    wfc->isFinished = true;
+    return WFC_SUCCESS;
+}
+
+//------------------------------------------------------------------------------------------
+// Groups
+//------------------------------------------------------------------------------------------
+
+static inline bool WFC__RuleHasTile(const WFC_State* wfc, int rule, int tile)
+{
+    return (wfc->_groupRuleTiles[(size_t) rule * wfc->tileWords + (tile >> 6)] >> (tile & 63)) & 1;
+}
+
+static inline bool WFC__InGroup(const WFC_State* wfc, int cellIdx, int groupIdx)
+{
+    for (int m = wfc->_cellGroupOffsets[cellIdx]; m < wfc->_cellGroupOffsets[cellIdx + 1]; m++)
+    {
+        if (wfc->_cellGroups[m] == groupIdx)
+            return true;
+    }
+
+    return false;
+}
+
+// Queues the rules of a group where a tile was placed for the first time, if any rule covers the tile
+static inline void WFC__QueueGroupEvent(WFC_State* wfc, int groupIdx, int tile)
+{
+    for (int r = 0; r < wfc->_groupRuleCount; r++)
+    {
+        if (WFC__RuleHasTile(wfc, r, tile))
+        {
+            wfc->_groupEvents[wfc->_groupEventCount++] = (WFC_GroupEvent) { groupIdx, tile };
+            return;
+        }
+    }
+}
+
+// Queues the groups of a cell whose domain changed, so that their AllDifferent rules are checked again
+static void WFC__TouchGroups(WFC_State* wfc, int cellIdx)
+{
+    if (wfc->_groupQueue == NULL || cellIdx >= wfc->_groupRowCells)
+        return;
+
+    for (int m = wfc->_cellGroupOffsets[cellIdx]; m < wfc->_cellGroupOffsets[cellIdx + 1]; m++)
+    {
+        int groupIdx = wfc->_cellGroups[m];
+        if (!wfc->_inGroupQueue[groupIdx])
+        {
+            wfc->_inGroupQueue[groupIdx] = true;
+            wfc->_groupQueue[wfc->_groupQueueCount++] = groupIdx;
+        }
+    }
+}
+
+static void WFC__QueueAllGroups(WFC_State* wfc)
+{
+    if (wfc->_groupQueue == NULL)
+        return;
+
+    for (int g = 0; g < wfc->groupCount; g++)
+    {
+        if (!wfc->_inGroupQueue[g])
+        {
+            wfc->_inGroupQueue[g] = true;
+            wfc->_groupQueue[wfc->_groupQueueCount++] = g;
+        }
     }
+}
 
-    wfc->wave[idx].validTileCount = wfc->tileCount;
-    wfc->wave[idx].neighbors = NULL;
-    wfc->wave[idx].neighborCount = 0;
-    wfc->wave[idx]._neighborCap = 0;
+static void WFC__ClearGroupQueues(WFC_State* wfc)
+{
+    wfc->_groupEventCount = 0;
+    while (wfc->_groupQueueCount > 0)
+        wfc->_inGroupQueue[wfc->_groupQueue[--wfc->_groupQueueCount]] = false;
+}
 
-    wfc->cellCount++;
+// Counts a tile placed in a cell in each of the cell's groups.
+static void WFC__GroupCollapsed(WFC_State* wfc, int cellIdx, int tile)
+{
+    if (cellIdx >= wfc->_groupRowCells)
+        return;
+
+    for (int m = wfc->_cellGroupOffsets[cellIdx]; m < wfc->_cellGroupOffsets[cellIdx + 1]; m++)
+    {
+        int groupIdx = wfc->_cellGroups[m];
+        if (wfc->_groupTileCounts[groupIdx * wfc->tileCount + tile]++ == 0)
+            WFC__QueueGroupEvent(wfc, groupIdx, tile);
+    }
+}
+
+// Recounts the collapsed cells of every group. If "queue" is set, the rules of every placed tile are applied again.
+static void WFC__CountGroupTiles(WFC_State* wfc, bool queue)
+{
+    if (wfc->_groupRowCells == 0)
+        return;
+
+    memset(wfc->_groupTileCounts, 0, (size_t) wfc->groupCount * wfc->tileCount * sizeof wfc->_groupTileCounts[0]);
+    for (int g = 0; g < wfc->groupCount; g++)
+    {
+        for (int m = wfc->_groupOffsets[g]; m < wfc->_groupOffsets[g + 1]; m++)
+        {
+            const WFC_CellState* cell = &wfc->_cells[wfc->_groupCells[m]];
+            if (cell->isCollapsed && wfc->_groupTileCounts[g * wfc->tileCount + cell->collapsedTile]++ == 0 && queue)
+                WFC__QueueGroupEvent(wfc, g, cell->collapsedTile);
+        }
+    }
+}
+
+// Matching between the cells of a group that can only take tiles of an AllDifferent rule and those tiles.
+// Nodes of the graph searched for strongly connected components are the cells (0 to n - 1), then the tiles.
+typedef struct
+{
+    WFC_State* wfc;
+    int n; // Cells in the matching
+    int* cells; // Length = n
+    int* cellMatch; // Tile matched to each cell. Length = n
+    int* tileMatch; // Cell matched to each tile, -1 if none. Length = tileCount
+    int* seen; // Last augmenting search that visited each tile. Length = tileCount
+    int* index; // Visit order of each node, 0 if not visited yet
+    int* low;
+    int* component;
+    int* stack;
+    int* onStack;
+    int counter;
+    int stackCount;
+    int componentCount;
+} WFC__Matching;
+
+// Looks for an augmenting path from cell "x", as in Kuhn's algorithm. Returns whether the cell got a tile.
+static bool WFC__Augment(WFC__Matching* m, int x, int search)
+{
+    const uint64_t* domain = WFC__Domain(m->wfc, m->cells[x]);
+    for (int w = 0; w < m->wfc->tileWords; w++)
+    {
+        for (uint64_t bits = domain[w]; bits != 0; bits &= bits - 1)
+        {
+            int t = w * 64 + WFC__CTZ64(bits);
+            if (m->seen[t] == search)
+                continue;
+            m->seen[t] = search;
+
+            if (m->tileMatch[t] < 0 || WFC__Augment(m, m->tileMatch[t], search))
+            {
+                m->tileMatch[t] = x;
+                m->cellMatch[x] = t;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+static void WFC__StrongConnect(WFC__Matching* m, int node);
+
+static inline void WFC__SccEdge(WFC__Matching* m, int node, int next)
+{
+    if (m->index[next] == 0)
+    {
+        WFC__StrongConnect(m, next);
+        if (m->low[next] < m->low[node])
+            m->low[node] = m->low[next];
+    }
+    else if (m->onStack[next] && m->index[next] < m->low[node])
+        m->low[node] = m->index[next];
+}
+
+// Tarjan's algorithm. Cells lead to the tiles they could take instead of their match, tiles lead to their matched cell.
+static void WFC__StrongConnect(WFC__Matching* m, int node)
+{
+    m->index[node] = m->low[node] = ++m->counter;
+    m->stack[m->stackCount++] = node;
+    m->onStack[node] = 1;
+
+    if (node < m->n)
+    {
+        const uint64_t* domain = WFC__Domain(m->wfc, m->cells[node]);
+        for (int w = 0; w < m->wfc->tileWords; w++)
+        {
+            for (uint64_t bits = domain[w]; bits != 0; bits &= bits - 1)
+            {
+                int t = w * 64 + WFC__CTZ64(bits);
+                if (t != m->cellMatch[node])
+                    WFC__SccEdge(m, node, m->n + t);
+            }
+        }
+    }
+    else if (m->tileMatch[node - m->n] >= 0)
+        WFC__SccEdge(m, node, m->tileMatch[node - m->n]);
+
+    if (m->low[node] == m->index[node])
+    {
+        int top;
+        do
+        {
+            top = m->stack[--m->stackCount];
+            m->onStack[top] = 0;
+            m->component[top] = m->componentCount;
+        } while (top != node);
+        m->componentCount++;
+    }
+}
+
+// Removes the tiles of an AllDifferent rule that no assignment of distinct tiles leaves at a cell (Regin's filter).
+// Cells that can only take tiles of the rule are matched to distinct tiles. A cell keeps a tile if some maximum
+// matching gives it that tile, and cells that can take other tiles lose the tiles every matching uses.
+// Returns 1 on a contradiction.
+static int WFC__FilterAllDifferent(WFC_State* wfc, int groupIdx, int rule)
+{
+    const int tileCount = wfc->tileCount;
+    const int words = wfc->tileWords;
+    const uint64_t* ruleTiles = &wfc->_groupRuleTiles[(size_t) rule * words];
+    const int first = wfc->_groupOffsets[groupIdx];
+    const int groupSize = wfc->_groupOffsets[groupIdx + 1] - first;
+    const int nodeCount = groupSize + tileCount;
+
+    WFC__Matching m;
+    m.wfc = wfc;
+    m.cells = wfc->_matchScratch;
+    m.cellMatch = m.cells + groupSize;
+    m.tileMatch = m.cellMatch + groupSize;
+    m.seen = m.tileMatch + tileCount;
+    m.index = m.seen + tileCount;
+    m.low = m.index + nodeCount;
+    m.component = m.low + nodeCount;
+    m.stack = m.component + nodeCount;
+    m.onStack = m.stack + nodeCount;
+
+    m.n = 0;
+    for (int i = first; i < first + groupSize; i++)
+    {
+        const uint64_t* domain = WFC__Domain(wfc, wfc->_groupCells[i]);
+        bool bound = true;
+        for (int w = 0; w < words && bound; w++)
+            bound = (domain[w] & ~ruleTiles[w]) == 0;
+        if (bound)
+            m.cells[m.n++] = wfc->_groupCells[i];
+    }
+
+    if (m.n == 0)
+        return 0;
+
+    // More cells than tiles to tell them apart, or a Hall set that's too small
+    for (int t = 0; t < tileCount; t++)
+        m.tileMatch[t] = m.seen[t] = -1;
+    for (int x = 0; x < m.n; x++)
+    {
+        if (!WFC__Augment(&m, x, x))
+            return 1;
+    }
+
+    // Tiles that some matching leaves free: the unmatched ones, and those whose cell can switch to a free tile
+    uint64_t* freeable = wfc->_rowScratch;
+    memcpy(freeable, ruleTiles, words * sizeof freeable[0]);
+    for (int x = 0; x < m.n; x++)
+        freeable[m.cellMatch[x] >> 6] &= ~(1ULL << (m.cellMatch[x] & 63));
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (int x = 0; x < m.n; x++)
+        {
+            int t = m.cellMatch[x];
+            if ((freeable[t >> 6] >> (t & 63)) & 1)
+                continue;
+
+            const uint64_t* domain = WFC__Domain(wfc, m.cells[x]);
+            for (int w = 0; w < words; w++)
+            {
+                if (domain[w] & freeable[w])
+                {
+                    freeable[t >> 6] |= 1ULL << (t & 63);
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Otherwise, a tile can only be swapped around a cycle of the matching
+    memset(m.index, 0, (m.n + tileCount) * sizeof m.index[0]);
+    m.counter = m.stackCount = m.componentCount = 0;
+    for (int x = 0; x < m.n; x++)
+    {
+        if (m.index[x] == 0)
+            WFC__StrongConnect(&m, x);
+    }
+
+    for (int x = 0; x < m.n; x++)
+    {
+        const uint64_t* domain = WFC__Domain(wfc, m.cells[x]);
+        for (int w = 0; w < words; w++)
+        {
+            for (uint64_t bits = domain[w]; bits != 0; bits &= bits - 1)
+            {
+                int t = w * 64 + WFC__CTZ64(bits);
+                if (t == m.cellMatch[x] || ((freeable[w] >> (t & 63)) & 1) || m.component[x] == m.component[m.n + t])
+                    continue;
+
+                if (WFC__RemoveTile(wfc, m.cells[x], t))
+                    return 1;
+            }
+        }
+    }
+
+    for (int i = first; i < first + groupSize; i++)
+    {
+        int cellIdx = wfc->_groupCells[i];
+        const uint64_t* domain = WFC__Domain(wfc, cellIdx);
+        bool bound = true;
+        for (int w = 0; w < words && bound; w++)
+            bound = (domain[w] & ~ruleTiles[w]) == 0;
+        if (bound)
+            continue;
+
+        for (int w = 0; w < words; w++)
+        {
+            for (uint64_t bits = domain[w] & ruleTiles[w] & ~freeable[w]; bits != 0; bits &= bits - 1)
+            {
+                if (WFC__RemoveTile(wfc, cellIdx, w * 64 + WFC__CTZ64(bits)))
+                    return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Applies the rules of a group where a tile was placed for the first time, or the AllDifferent rules of a changed group.
+// Returns 1 on a contradiction.
+static int WFC__PropagateGroups(WFC_State* wfc)
+{
+    if (wfc->_groupEventCount == 0)
+    {
+        int groupIdx = wfc->_groupQueue[--wfc->_groupQueueCount];
+        wfc->_inGroupQueue[groupIdx] = false;
+
+        for (int r = 0; r < wfc->_groupRuleCount; r++)
+        {
+            if (wfc->_groupRules[r] == WFC_GROUP_ALL_DIFFERENT && WFC__FilterAllDifferent(wfc, groupIdx, r))
+                return 1;
+        }
+
+        return 0;
+    }
+
+    WFC_GroupEvent event = wfc->_groupEvents[--wfc->_groupEventCount];
+
+    for (int r = 0; r < wfc->_groupRuleCount; r++)
+    {
+        if (!WFC__RuleHasTile(wfc, r, event.tile))
+            continue;
+
+        if (wfc->_groupRules[r] == WFC_GROUP_ALL_DIFFERENT)
+        {
+            // Ban the tile from the rest of the group
+            if (wfc->_groupTileCounts[event.group * wfc->tileCount + event.tile] > 1)
+                return 1;
+
+            for (int m = wfc->_groupOffsets[event.group]; m < wfc->_groupOffsets[event.group + 1]; m++)
+            {
+                int cellIdx = wfc->_groupCells[m];
+                const WFC_CellState* cell = &wfc->_cells[cellIdx];
+                if (!(cell->isCollapsed && cell->collapsedTile == event.tile) && WFC__RemoveTile(wfc, cellIdx, event.tile))
+                    return 1;
+            }
+        }
+        else if (wfc->_groupRules[r] == WFC_GROUP_EXCLUSIVE)
+        {
+            // Ban the other tiles of the set from the whole group
+            const uint64_t* ruleTiles = &wfc->_groupRuleTiles[(size_t) r * wfc->tileWords];
+            for (int m = wfc->_groupOffsets[event.group]; m < wfc->_groupOffsets[event.group + 1]; m++)
+            {
+                int cellIdx = wfc->_groupCells[m];
+                for (int w = 0; w < wfc->tileWords; w++)
+                {
+                    for (uint64_t bits = WFC__Domain(wfc, cellIdx)[w] & ruleTiles[w]; bits != 0; bits &= bits - 1)
+                    {
+                        int t = w * 64 + WFC__CTZ64(bits);
+                        if (t != event.tile && WFC__RemoveTile(wfc, cellIdx, t))
+                            return 1;
+                    }
+                }
+            }
+        }
+        else
+        {
+            // Ban the tile from the cells of every other group
+            for (int g = 0; g < wfc->groupCount; g++)
+            {
+                if (g == event.group)
+                    continue;
+
+                for (int m = wfc->_groupOffsets[g]; m < wfc->_groupOffsets[g + 1]; m++)
+                {
+                    int cellIdx = wfc->_groupCells[m];
+                    if (!WFC__InGroup(wfc, cellIdx, event.group) && WFC__RemoveTile(wfc, cellIdx, event.tile))
+                        return 1;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Copies the groups, memberships and group rules of "src" into "dst", which has none yet.
+static int WFC__CopyGroups(WFC_State* dst, const WFC_State* src)
+{
+    for (int g = 0; g < src->groupCount; g++)
+        WFC_AddGroup(dst);
+
+    for (int m = 0; m < src->_memberCount; m++)
+    {
+        if (WFC_AddToGroup(dst, src->_members[m].group, src->_members[m].cell))
+            return 1;
+    }
+
+    if (src->_groupRuleCount > 0)
+    {
+        const size_t tileWords = (size_t) src->_groupRuleCount * src->tileWords;
+        dst->_groupRules = WFC_MALLOC(src->_groupRuleCount * sizeof dst->_groupRules[0]);
+        dst->_groupRuleTiles = WFC_MALLOC(tileWords * sizeof dst->_groupRuleTiles[0]);
+        if (dst->_groupRules == NULL || dst->_groupRuleTiles == NULL)
+            return 1;
+
+        memcpy(dst->_groupRules, src->_groupRules, src->_groupRuleCount * sizeof dst->_groupRules[0]);
+        memcpy(dst->_groupRuleTiles, src->_groupRuleTiles, tileWords * sizeof dst->_groupRuleTiles[0]);
+        dst->_groupRuleCount = src->_groupRuleCount;
+    }
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------------------
+// Tile limits
+//------------------------------------------------------------------------------------------
+
+// Limits how many cells of a group take a tile, or of the whole wave if "groupIdx" is -1.
+// Use 0 as "min" or the cell count as "max" to only bound one side.
+// Returns 1 if there was an allocation error.
+int WFC_AddTileLimit(WFC_State* wfc, int groupIdx, int tile, int min, int max)
+{
+    assert(wfc != NULL && wfc->initialized);
+    assert(groupIdx >= -1 && groupIdx < wfc->groupCount);
+    assert(tile >= 0 && tile < wfc->tileCount);
+    assert(min >= 0 && min <= max);
+
+    WFC_TileLimit* new_limits = WFC_REALLOC(wfc->_limits, (wfc->_limitCount + 1) * sizeof wfc->_limits[0]);
+    if (new_limits == NULL)
+        return 1;
+    wfc->_limits = new_limits;
+
+    wfc->_limits[wfc->_limitCount++] = (WFC_TileLimit) { groupIdx, tile, min, max };
     wfc->_dirty = true;
+    return 0;
+}
 
-    return idx;
+static void WFC__FreeLimitRows(WFC_State* wfc)
+{
+    WFC_FREE(wfc->_limitOffsets);
+    WFC_FREE(wfc->_limitsByTile);
+    WFC_FREE(wfc->_limitPlaced);
+    WFC_FREE(wfc->_limitCandidates);
+    WFC_FREE(wfc->_limitQueue);
+    WFC_FREE(wfc->_inLimitQueue);
+    wfc->_limitOffsets = wfc->_limitsByTile = NULL;
+    wfc->_limitPlaced = wfc->_limitCandidates = NULL;
+    wfc->_limitQueue = NULL;
+    wfc->_inLimitQueue = NULL;
+    wfc->_limitQueueCount = 0;
 }
 
-int WFC_AddNeighbor(WFC_State* wfc, int idxCell, int idxNeighbor, int rel)
+// Sorts the limits into rows by tile and counts them over the current domains.
+// Runs after WFC__BuildGroups, since group limits look up the group rows.
+static int WFC__BuildLimits(WFC_State* wfc)
 {
-    assert (wfc != NULL);
-    assert (idxCell >= 0 && idxNeighbor >= 0);
+    WFC__FreeLimitRows(wfc);
+    if (wfc->_limitCount == 0)
+        return 0;
 
-    /* if (idxCell >= wfc->tileCount || idxNeighbor >= wfc->tileCount) */
-    /*  return 1; */
+    const int limitCount = wfc->_limitCount;
+    wfc->_limitOffsets = WFC_CALLOC(wfc->tileCount + 1, sizeof wfc->_limitOffsets[0]);
+    wfc->_limitsByTile = WFC_MALLOC(limitCount * sizeof wfc->_limitsByTile[0]);
+    wfc->_limitPlaced = WFC_MALLOC(limitCount * sizeof wfc->_limitPlaced[0]);
+    wfc->_limitCandidates = WFC_MALLOC(limitCount * sizeof wfc->_limitCandidates[0]);
+    wfc->_limitQueue = WFC_MALLOC(limitCount * sizeof wfc->_limitQueue[0]);
+    wfc->_inLimitQueue = WFC_CALLOC(limitCount, sizeof wfc->_inLimitQueue[0]);
+    if (wfc->_limitOffsets == NULL || wfc->_limitsByTile == NULL || wfc->_limitPlaced == NULL
+        || wfc->_limitCandidates == NULL || wfc->_limitQueue == NULL || wfc->_inLimitQueue == NULL)
+    {
+        WFC__FreeLimitRows(wfc);
+        return 1;
+    }
 
-    /* if (rel < 0) */
-    /*  rel = wfc->relFunction(wfc, idxCell, idxNeighbor); */
+    for (int l = 0; l < limitCount; l++)
+        wfc->_limitOffsets[wfc->_limits[l].tile + 1]++;
+    for (int t = 0; t < wfc->tileCount; t++)
+        wfc->_limitOffsets[t + 1] += wfc->_limitOffsets[t];
+
+    // Fill each row using its start as a cursor, then shift the starts back into place
+    for (int l = 0; l < limitCount; l++)
+        wfc->_limitsByTile[wfc->_limitOffsets[wfc->_limits[l].tile]++] = l;
+    memmove(&wfc->_limitOffsets[1], wfc->_limitOffsets, wfc->tileCount * sizeof wfc->_limitOffsets[0]);
+    wfc->_limitOffsets[0] = 0;
+
+    WFC__CountLimits(wfc);
+    return 0;
+}
+
+static inline bool WFC__LimitCovers(const WFC_State* wfc, const WFC_TileLimit* limit, int cellIdx)
+{
+    return limit->group < 0 || (cellIdx < wfc->_groupRowCells && WFC__InGroup(wfc, cellIdx, limit->group));
+}
+
+// Queues a limit if it was broken, or if it reached a bound that hasn't been applied yet
+static inline void WFC__CheckLimit(WFC_State* wfc, int l)
+{
+    const WFC_TileLimit* limit = &wfc->_limits[l];
+    const int placed = wfc->_limitPlaced[l];
+    const int candidates = wfc->_limitCandidates[l];
+
+    bool pending = placed > limit->max || candidates < limit->min
+        || (placed == limit->max && candidates > placed)
+        || (candidates == limit->min && placed < candidates);
+
+    if (pending && !wfc->_inLimitQueue[l])
+    {
+        wfc->_inLimitQueue[l] = true;
+        wfc->_limitQueue[wfc->_limitQueueCount++] = l;
+    }
+}
+
+// Recounts every limit over the current domains, and queues those that reached a bound
+static void WFC__CountLimits(WFC_State* wfc)
+{
+    if (wfc->_limitOffsets == NULL)
+        return;
+
+    while (wfc->_limitQueueCount > 0)
+        wfc->_inLimitQueue[wfc->_limitQueue[--wfc->_limitQueueCount]] = false;
+
+    for (int l = 0; l < wfc->_limitCount; l++)
+    {
+        const WFC_TileLimit* limit = &wfc->_limits[l];
+        const bool inGroup = limit->group >= 0;
+        const int first = inGroup ? wfc->_groupOffsets[limit->group] : 0;
+        const int last = inGroup ? wfc->_groupOffsets[limit->group + 1] : wfc->cellCount;
+
+        int placed = 0, candidates = 0;
+        for (int i = first; i < last; i++)
+        {
+            int cellIdx = inGroup ? wfc->_groupCells[i] : i;
+            const WFC_CellState* cell = &wfc->_cells[cellIdx];
+            candidates += WFC_IsTileValid(wfc, cellIdx, limit->tile);
+            placed += cell->isCollapsed && cell->collapsedTile == limit->tile;
+        }
+
+        wfc->_limitPlaced[l] = placed;
+        wfc->_limitCandidates[l] = candidates;
+        WFC__CheckLimit(wfc, l);
+    }
+}
+
+// Uncounts a tile removed from a cell
+static void WFC__LimitRemoved(WFC_State* wfc, int cellIdx, int tile)
+{
+    if (wfc->_limitOffsets == NULL)
+        return;
+
+    for (int k = wfc->_limitOffsets[tile]; k < wfc->_limitOffsets[tile + 1]; k++)
+    {
+        int l = wfc->_limitsByTile[k];
+        if (WFC__LimitCovers(wfc, &wfc->_limits[l], cellIdx))
+        {
+            wfc->_limitCandidates[l]--;
+            WFC__CheckLimit(wfc, l);
+        }
+    }
+}
+
+// Counts a tile placed in a cell
+static void WFC__LimitCollapsed(WFC_State* wfc, int cellIdx, int tile)
+{
+    if (wfc->_limitOffsets == NULL)
+        return;
+
+    for (int k = wfc->_limitOffsets[tile]; k < wfc->_limitOffsets[tile + 1]; k++)
+    {
+        int l = wfc->_limitsByTile[k];
+        if (WFC__LimitCovers(wfc, &wfc->_limits[l], cellIdx))
+        {
+            wfc->_limitPlaced[l]++;
+            WFC__CheckLimit(wfc, l);
+        }
+    }
+}
+
+// Counts back the tiles an undo gives back to a cell, before its domain is restored.
+// Undoing only ever loosens the limits, so nothing is queued.
+static void WFC__RestoreLimits(WFC_State* wfc, int cellIdx, const uint64_t* savedTiles, bool wasCollapsed)
+{
+    if (wfc->_limitOffsets == NULL)
+        return;
+
+    const uint64_t* validTiles = WFC__Domain(wfc, cellIdx);
+    for (int w = 0; w < wfc->tileWords; w++)
+    {
+        for (uint64_t bits = savedTiles[w] & ~validTiles[w]; bits != 0; bits &= bits - 1)
+        {
+            int t = w * 64 + WFC__CTZ64(bits);
+            for (int k = wfc->_limitOffsets[t]; k < wfc->_limitOffsets[t + 1]; k++)
+            {
+                if (WFC__LimitCovers(wfc, &wfc->_limits[wfc->_limitsByTile[k]], cellIdx))
+                    wfc->_limitCandidates[wfc->_limitsByTile[k]]++;
+            }
+        }
+    }
+
+    const WFC_CellState* cell = &wfc->_cells[cellIdx];
+    if (!cell->isCollapsed || wasCollapsed)
+        return;
+
+    for (int k = wfc->_limitOffsets[cell->collapsedTile]; k < wfc->_limitOffsets[cell->collapsedTile + 1]; k++)
+    {
+        if (WFC__LimitCovers(wfc, &wfc->_limits[wfc->_limitsByTile[k]], cellIdx))
+            wfc->_limitPlaced[wfc->_limitsByTile[k]]--;
+    }
+}
+
+// Applies a limit that reached a bound: once the maximum is placed the tile is banned from the other cells,
+// and once only the minimum of cells can still take it, they all do.
+// Returns 1 on a contradiction.
+static int WFC__PropagateLimits(WFC_State* wfc)
+{
+    int l = wfc->_limitQueue[--wfc->_limitQueueCount];
+    wfc->_inLimitQueue[l] = false;
+
+    const WFC_TileLimit limit = wfc->_limits[l];
+    const int placed = wfc->_limitPlaced[l];
+    const int candidates = wfc->_limitCandidates[l];
+    if (placed > limit.max || candidates < limit.min)
+        return 1;
+
+    const bool ban = placed == limit.max && candidates > placed;
+    const bool force = candidates == limit.min && placed < candidates;
+    if (!ban && !force)
+        return 0;
+
+    const bool inGroup = limit.group >= 0;
+    const int first = inGroup ? wfc->_groupOffsets[limit.group] : 0;
+    const int last = inGroup ? wfc->_groupOffsets[limit.group + 1] : wfc->cellCount;
+
+    for (int i = first; i < last; i++)
+    {
+        int cellIdx = inGroup ? wfc->_groupCells[i] : i;
+        if (wfc->_cells[cellIdx].isCollapsed || !WFC_IsTileValid(wfc, cellIdx, limit.tile))
+            continue;
+
+        if (ban)
+        {
+            if (WFC__RemoveTile(wfc, cellIdx, limit.tile))
+                return 1;
+            continue;
+        }
+
+        // Force the tile by removing every other one
+        for (int w = 0; w < wfc->tileWords; w++)
+        {
+            for (uint64_t bits = WFC__Domain(wfc, cellIdx)[w]; bits != 0; bits &= bits - 1)
+            {
+                int t = w * 64 + WFC__CTZ64(bits);
+                if (t != limit.tile && WFC__RemoveTile(wfc, cellIdx, t))
+                    return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------------------
+// Connectivity
+//------------------------------------------------------------------------------------------
+
+enum
+{
+    WFC__CONN_BLOCKED, // No passable tile left
+    WFC__CONN_MAYBE,
+    WFC__CONN_PASSABLE, // Only passable tiles left
+};
 
-    return WFC__AddToNeighborList(wfc, idxCell, idxNeighbor, rel);
+static int WFC__AddConnectivity(WFC_State* wfc, const uint64_t* tiles, WFC_Connectivity conn)
+{
+    WFC_Connectivity* new_conns = WFC_REALLOC(wfc->_conns, (wfc->_connCount + 1) * sizeof wfc->_conns[0]);
+    if (new_conns == NULL)
+        return 1;
+    wfc->_conns = new_conns;
+
+    uint64_t* new_tiles = WFC_REALLOC(wfc->_connTiles, (size_t) (wfc->_connCount + 1) * wfc->tileWords * sizeof wfc->_connTiles[0]);
+    if (new_tiles == NULL)
+        return 1;
+    wfc->_connTiles = new_tiles;
+
+    memcpy(&wfc->_connTiles[(size_t) wfc->_connCount * wfc->tileWords], tiles, wfc->tileWords * sizeof tiles[0]);
+    wfc->_conns[wfc->_connCount++] = conn;
+    wfc->_dirty = true;
+    return 0;
 }
 
-int WFC_CalculateNeighbors(WFC_State* wfc, RelationshipFunction relFunc)
+// Keeps the cells that take one of "tiles" connected to "seedCell", or to each other if it's -1.
+// Cells are connected by the edges whose relation is in "relMask" (bit r for relation r), in either direction.
+// Grid neighbors are connected if the relations of both directions are in it. The seed cell must take a passable tile.
+// The mask has one bit per relation, so the state can have at most 32 relations.
+// Returns 1 if there was an allocation error.
+int WFC_AddConnectivity(WFC_State* wfc, const int* tiles, int count, int seedCell, uint32_t relMask)
 {
-    assert (wfc != NULL);
+    assert(wfc != NULL && wfc->initialized);
+    assert(wfc->relCount <= 32);
+    assert(tiles != NULL || count == 0);
+    assert(seedCell >= -1 && seedCell < wfc->cellCount);
 
-    // WARN: This is dumb, stupid, and possibly dangerous.
-    for (int i = 0; i < wfc->cellCount; i++)
+    uint64_t* passable = wfc->_rowScratch;
+    memset(passable, 0, wfc->tileWords * sizeof passable[0]);
+    for (int i = 0; i < count; i++)
     {
-        if (wfc->wave[i].neighbors != NULL)
-        {
-            WFC_FREE(wfc->wave[i].neighbors);
-            wfc->wave[i].neighbors = NULL;
-        }
+        assert(tiles[i] >= 0 && tiles[i] < wfc->tileCount);
+        passable[tiles[i] >> 6] |= 1ULL << (tiles[i] & 63);
     }
 
-    return WFC__NeighborSetup(wfc, relFunc);
+    return WFC__AddConnectivity(wfc, passable, (WFC_Connectivity) { seedCell, relMask });
 }
 
-// Updates all cells in the WFC state if dirty, refitting dynamic arrays and recalculating neighbors.
-// FIXME: I'm not treating this function's error case well enough in its usages!
-static int WFC__RefitState (WFC_State* wfc)
+static void WFC__FreeConnRows(WFC_State* wfc)
 {
-    assert(wfc != NULL);
+    WFC_FREE(wfc->_connStates);
+    WFC_FREE(wfc->_connAdjOffsets);
+    WFC_FREE(wfc->_connAdj);
+    WFC_FREE(wfc->_connAdjRel);
+    WFC_FREE(wfc->_connScratch);
+    WFC_FREE(wfc->_connQueue);
+    WFC_FREE(wfc->_inConnQueue);
+    wfc->_connStates = NULL;
+    wfc->_connAdjOffsets = wfc->_connAdj = wfc->_connAdjRel = NULL;
+    wfc->_connScratch = wfc->_connQueue = NULL;
+    wfc->_inConnQueue = NULL;
+    wfc->_connCells = wfc->_connQueueCount = 0;
+}
 
-    if (!wfc->_dirty)
+// Builds the explicit edges in both directions, since a connection doesn't depend on which cell an edge starts from.
+// Grid neighbors are found on the fly.
+static int WFC__BuildConnectivity(WFC_State* wfc)
+{
+    WFC__FreeConnRows(wfc);
+    if (wfc->_connCount == 0)
         return 0;
 
-    // Readjust wave array's size
-    if (wfc->_cellCap > wfc->cellCount)
+    const int cellCount = wfc->cellCount;
+    const int edgeCount = wfc->_adjCells > 0 ? wfc->_adjOffsets[wfc->_adjCells] : 0;
+    wfc->_connStates = WFC_MALLOC((size_t) wfc->_connCount * cellCount + 1);
+    wfc->_connAdjOffsets = WFC_CALLOC(cellCount + 1, sizeof wfc->_connAdjOffsets[0]);
+    wfc->_connAdj = WFC_MALLOC((2 * (size_t) edgeCount + 1) * sizeof wfc->_connAdj[0]);
+    wfc->_connAdjRel = WFC_MALLOC((2 * (size_t) edgeCount + 1) * sizeof wfc->_connAdjRel[0]);
+    wfc->_connScratch = WFC_MALLOC((5 * (size_t) cellCount + 1) * sizeof wfc->_connScratch[0]);
+    wfc->_connQueue = WFC_MALLOC(wfc->_connCount * sizeof wfc->_connQueue[0]);
+    wfc->_inConnQueue = WFC_CALLOC(wfc->_connCount, sizeof wfc->_inConnQueue[0]);
+    if (wfc->_connStates == NULL || wfc->_connAdjOffsets == NULL || wfc->_connAdj == NULL || wfc->_connAdjRel == NULL
+        || wfc->_connScratch == NULL || wfc->_connQueue == NULL || wfc->_inConnQueue == NULL)
     {
-        WFC_Cell* new_ptr = WFC_REALLOC(wfc->wave, wfc->cellCount * sizeof wfc->wave[0]);
-        if (new_ptr == NULL)
+        WFC__FreeConnRows(wfc);
+        return 1;
+    }
+    wfc->_connCells = cellCount;
+
+    for (int i = 0; i < wfc->_adjCells; i++)
+    {
+        for (int e = wfc->_adjOffsets[i]; e < wfc->_adjOffsets[i + 1]; e++)
         {
-            // Failed to reallocate
-            return 1;
+            wfc->_connAdjOffsets[i + 1]++;
+            wfc->_connAdjOffsets[wfc->_adjIdx[e] + 1]++;
         }
-
-        wfc->wave = new_ptr;
-        wfc->_cellCap = wfc->cellCount;
     }
+    for (int i = 0; i < cellCount; i++)
+        wfc->_connAdjOffsets[i + 1] += wfc->_connAdjOffsets[i];
 
-    /* int error = WFC_CalculateNeighbors(wfc); */
-    /* if (error) */
-    /*  return 1; */
-
-    for (int i = 0; i < wfc->cellCount; i++)
+    // Fill each row using its start as a cursor, then shift the starts back into place
+    for (int i = 0; i < wfc->_adjCells; i++)
     {
-        WFC_Cell* cell = &wfc->wave[i];
-        if (cell->neighbors == NULL)
-            continue;
-
-        if (cell->_neighborCap > cell->neighborCount)
+        for (int e = wfc->_adjOffsets[i]; e < wfc->_adjOffsets[i + 1]; e++)
         {
-            cell->_neighborCap = cell->neighborCount;
-            void* new_ptr = WFC_REALLOC(cell->neighbors, cell->_neighborCap * sizeof cell->neighbors[0]);
-            if (new_ptr == NULL)
-            {
-                WFC_FREE(cell->neighbors);
-                cell->neighbors = NULL;
-                return 1;
-            }
-
-            cell->neighbors = new_ptr;
+            int to = wfc->_adjIdx[e];
+            wfc->_connAdj[wfc->_connAdjOffsets[i]] = to;
+            wfc->_connAdjRel[wfc->_connAdjOffsets[i]++] = wfc->_adjRel[e];
+            wfc->_connAdj[wfc->_connAdjOffsets[to]] = i;
+            wfc->_connAdjRel[wfc->_connAdjOffsets[to]++] = wfc->_adjRel[e];
         }
     }
+    memmove(&wfc->_connAdjOffsets[1], wfc->_connAdjOffsets, cellCount * sizeof wfc->_connAdjOffsets[0]);
+    wfc->_connAdjOffsets[0] = 0;
 
-    wfc->_dirty = false;
+    WFC__CountConnectivity(wfc, true);
     return 0;
 }
 
-static inline int WFC__PropIdx(WFC_State* wfc, int rel, int from, int to)
+// Whether a relationship connects cells. A composite connects them if any of its parts does.
+static inline bool WFC__ConnRel(const WFC_State* wfc, uint32_t relMask, int rel)
 {
-    return ((rel) * wfc->tileCount * wfc->tileCount) + (from) * wfc->tileCount + (to);
+    int buffer;
+    const int* parts = WFC__CompositeParts(wfc, rel, &buffer);
+    for (int p = WFC__CompositePartCount(wfc, rel) - 1; p >= 0; p--)
+    {
+        if (parts[p] >= 0 && parts[p] < 32 && ((relMask >> parts[p]) & 1))
+            return true;
+    }
+
+    return false;
 }
 
-// NOTE: should I pass in the tile, or the tile index?
-void WFC_SetRule(WFC_State* wfc, Tile sTile, Tile dTile, int rel, bool allowed)
+static inline uint8_t WFC__ConnState(const WFC_State* wfc, int c, int cellIdx)
 {
-    assert(wfc != NULL && wfc->initialized);
-    assert(sTile.val < wfc->tileCount && dTile.val < wfc->tileCount);
+    const uint64_t* passable = &wfc->_connTiles[(size_t) c * wfc->tileWords];
+    const uint64_t* domain = WFC__Domain(wfc, cellIdx);
+    uint64_t inside = 0, outside = 0;
+    for (int w = 0; w < wfc->tileWords; w++)
+    {
+        inside |= domain[w] & passable[w];
+        outside |= domain[w] & ~passable[w];
+    }
 
-    wfc->propagator[WFC__PropIdx(wfc, rel, sTile.val, dTile.val)] = allowed;
+    if (inside == 0)
+        return WFC__CONN_BLOCKED;
+    return outside == 0 ? WFC__CONN_PASSABLE : WFC__CONN_MAYBE;
 }
 
-//------------------------------------------------------------------------------------------
-// Actual WFC code
-//------------------------------------------------------------------------------------------
-
-static inline void WFC__AddProp(WFC_State* wfc, int from, int to, int rel)
+static inline void WFC__QueueConnectivity(WFC_State* wfc, int c)
 {
-    // TODO: should I validate props for uniqueness?
-    if (wfc->propCount < MAX_PROPS)
+    if (!wfc->_inConnQueue[c])
     {
-        wfc->props[wfc->propCount] = (WFC_Prop) { from, to , rel};
-        wfc->propCount++;
+        wfc->_inConnQueue[c] = true;
+        wfc->_connQueue[wfc->_connQueueCount++] = c;
     }
 }
 
-static inline bool WFC__PropsLeft(WFC_State* wfc)
+// Recomputes the state of every cell, and queues every rule if "queue" is set
+static void WFC__CountConnectivity(WFC_State* wfc, bool queue)
 {
-    return wfc->propCount > 0;
-}
+    if (wfc->_connStates == NULL)
+        return;
 
-int WFC__Propagate(WFC_State* wfc);
+    while (wfc->_connQueueCount > 0)
+        wfc->_inConnQueue[wfc->_connQueue[--wfc->_connQueueCount]] = false;
+
+    for (int c = 0; c < wfc->_connCount; c++)
+    {
+        for (int i = 0; i < wfc->_connCells; i++)
+            wfc->_connStates[(size_t) c * wfc->_connCells + i] = WFC__ConnState(wfc, c, i);
+        if (queue)
+            WFC__QueueConnectivity(wfc, c);
+    }
+}
 
-static inline void WFC__SetCollapsed(WFC_State* wfc, WFC_Cell* cellToCollapse, int toTile)
+// Updates the state of a cell whose domain changed. If "queue" is set, the rules it changed for are checked again.
+static void WFC__TouchConnectivity(WFC_State* wfc, int cellIdx, bool queue)
 {
-    // Set valid cell and weights for collapsed cell
-    memset(cellToCollapse->validTiles, 0, sizeof(Tile) * wfc->tileCount);
-    cellToCollapse->validTiles[toTile] = true;
-    cellToCollapse->isCollapsed = true;
-    cellToCollapse->collapsedTile = toTile;
-    cellToCollapse->validTileCount = 1;
-    cellToCollapse->sumWeights = 0;
+    if (wfc->_connStates == NULL || cellIdx >= wfc->_connCells)
+        return;
 
-    for (int n = 0; n < cellToCollapse->neighborCount; n++)
+    for (int c = 0; c < wfc->_connCount; c++)
     {
-        // TODO: change this indirection here by making an "observed" vector
-        if (wfc->wave[cellToCollapse->neighbors[n].idx].isCollapsed)
+        uint8_t* state = &wfc->_connStates[(size_t) c * wfc->_connCells + cellIdx];
+        uint8_t newState = WFC__ConnState(wfc, c, cellIdx);
+        if (*state == newState)
             continue;
-        WFC__AddProp(wfc, cellToCollapse->idx, cellToCollapse->neighbors[n].idx, cellToCollapse->neighbors[n].rel);
+
+        *state = newState;
+        if (queue)
+            WFC__QueueConnectivity(wfc, c);
     }
 }
 
-void WFC_SetTileTo(WFC_State* wfc, int cellIdx, int tile)
+// Returns the n-th cell a rule connects to "cellIdx", or -1 if it doesn't, and -2 past the last one.
+// Grid neighbors come first.
+static inline int WFC__ConnNeighbor(const WFC_State* wfc, const WFC_Connectivity* conn, int cellIdx, int n)
 {
-    assert(wfc != NULL && wfc->initialized);
-    assert(wfc->wave != NULL && cellIdx < wfc->cellCount);
+    int gridNeighbors[6];
+    int dirs = WFC__GridNeighbors(wfc, cellIdx, gridNeighbors);
+    if (n < dirs)
+    {
+        bool connected = WFC__ConnRel(wfc, conn->relMask, wfc->_grid.rels[n]) && WFC__ConnRel(wfc, conn->relMask, wfc->_grid.rels[n ^ 1]);
+        return connected ? gridNeighbors[n] : -1;
+    }
 
-    // In case the state is dirty.
-    if (WFC__RefitState(wfc))
-        return;
+    int e = wfc->_connAdjOffsets[cellIdx] + n - dirs;
+    if (e >= wfc->_connAdjOffsets[cellIdx + 1])
+        return -2;
+    return WFC__ConnRel(wfc, conn->relMask, wfc->_connAdjRel[e]) ? wfc->_connAdj[e] : -1;
+}
 
-    WFC_Cell* cellToCollapse = &wfc->wave[cellIdx];
+// Checks a connectivity rule. Cells the seed can't reach through cells that may be passable can't be passable
+// either. Cells that cut the seed off from a cell that must be passable have to be passable themselves, which is
+// found with a depth-first search over the cells that may be passable, keeping the lowest visit time each subtree
+// reaches (Tarjan's articulation points).
+// Returns 1 on a contradiction.
+static int WFC__PropagateConnectivity(WFC_State* wfc)
+{
+    int c = wfc->_connQueue[--wfc->_connQueueCount];
+    wfc->_inConnQueue[c] = false;
 
-    if (cellToCollapse->isCollapsed)
-        return;
+    const WFC_Connectivity conn = wfc->_conns[c];
+    const uint64_t* passable = &wfc->_connTiles[(size_t) c * wfc->tileWords];
+    const int cellCount = wfc->_connCells;
+    const uint8_t* states = &wfc->_connStates[(size_t) c * cellCount];
+
+    int root = conn.seed;
+    for (int i = 0; i < cellCount && root < 0; i++)
+    {
+        if (states[i] == WFC__CONN_PASSABLE)
+            root = i;
+    }
 
-    cellToCollapse->initialTile = tile;
-    WFC__SetCollapsed(wfc, cellToCollapse, tile);
+    // Nothing has to be connected yet
+    if (root < 0)
+        return 0;
 
-    while (WFC__PropsLeft(wfc))
+    if (states[root] == WFC__CONN_BLOCKED)
+        return 1;
+
+    int* order = wfc->_connScratch; // Visit time, 0 if not visited
+    int* low = order + cellCount;
+    int* parent = low + cellCount;
+    int* next = parent + cellCount; // Next neighbor to look at
+    int* needed = next + cellCount; // Whether the subtree has a cell that must be passable, then whether the cell is a cut
+    memset(order, 0, cellCount * sizeof order[0]);
+
+    // Iterative, since paths can be as long as the wave
+    int time = 0;
+    int top = root;
+    order[root] = low[root] = ++time;
+    parent[root] = -1;
+    next[root] = 0;
+    needed[root] = 0;
+    while (top >= 0)
     {
-        WFC__Propagate(wfc);
+        int n = WFC__ConnNeighbor(wfc, &conn, top, next[top]);
+        if (n != -2)
+        {
+            next[top]++;
+            if (n < 0 || states[n] == WFC__CONN_BLOCKED)
+                continue;
+
+            if (order[n] == 0)
+            {
+                order[n] = low[n] = ++time;
+                parent[n] = top;
+                next[n] = 0;
+                needed[n] = states[n] == WFC__CONN_PASSABLE;
+                top = n;
+            }
+            else if (order[n] < low[top])
+                low[top] = order[n];
+            continue;
+        }
+
+        // Done with this cell, hand its results to its parent
+        int done = top;
+        top = parent[done];
+        if (top < 0)
+            break;
+
+        if (low[done] < low[top])
+            low[top] = low[done];
+        // The parent is a cut if the subtree can't reach above it and has a cell that must be passable
+        if (low[done] >= order[top] && (needed[done] & 1))
+            needed[top] |= 2;
+        needed[top] |= needed[done] & 1;
     }
-}
 
-void WFC__Collapse(WFC_State* wfc, int cellIdx)
-{
-    /* int choice = rand() % (int) (wfc->wave[cellIdx].sumWeights); */
-    float choice = (float) rand() / (float)(RAND_MAX / wfc->wave[cellIdx].sumWeights);
-    int chosenTile = -1;
-    for (int i = 0; i < wfc->tileCount; i++)
+    // Flagged cuts are only seen once the search is done, so remove tiles afterwards
+    for (int i = 0; i < cellCount; i++)
     {
-        if (wfc->wave[cellIdx].validTiles[i] == false)
+        bool unreachable = order[i] == 0;
+        bool cut = !unreachable && (needed[i] & 2) && i != root;
+        if (i == root)
+            cut = states[i] == WFC__CONN_MAYBE;
+        if (states[i] == WFC__CONN_BLOCKED || (!unreachable && !cut))
             continue;
 
-        float weight = wfc->tileset[i].weight;
-        if (choice >= weight)
-        {
-            choice -= weight;
-        }
-        else
+        // Unreachable cells lose their passable tiles, cuts and the seed keep only those
+        for (int w = 0; w < wfc->tileWords; w++)
         {
-            chosenTile = wfc->tileset[i].val;
-            break;
+            uint64_t remove = unreachable ? WFC__Domain(wfc, i)[w] & passable[w] : WFC__Domain(wfc, i)[w] & ~passable[w];
+            for (uint64_t bits = remove; bits != 0; bits &= bits - 1)
+            {
+                if (WFC__RemoveTile(wfc, i, w * 64 + WFC__CTZ64(bits)))
+                    return 1;
+            }
         }
     }
 
-    // FIXME: this treatment is horrible
-    if (chosenTile == -1)
-        return;
-
-    WFC__SetCollapsed(wfc, &wfc->wave[cellIdx], chosenTile);
+    return 0;
 }
 
-// FIXME: doesn't seem to work when a cell has a known (0 valid elements). Test in the sudoku!
-int WFC__Observe(WFC_State* wfc)
+//------------------------------------------------------------------------------------------
+// Batches
+//------------------------------------------------------------------------------------------
+
+// Initializes "dst" with the cells, neighbors, initial tiles and settings of "src".
+// The clone references the rules of "src" instead of copying them, so they must outlive it.
+// Returns 1 on failure, leaving "dst" uninitialized.
+int WFC_Clone(WFC_State* dst, const WFC_State* src)
 {
-    double min = DBL_MAX; // The minimum entropy
-    int arg_min = -1; // The index of the cell with minimum entropy
+    assert(src != NULL && src->initialized);
+    assert(dst != NULL && !dst->initialized);
+    // The clone can't compile rules it doesn't own
+    assert(src->engine != WFC_ENGINE_AC4 || src->rules->compiled);
+
+    if (WFC__InitState(dst, src->rules))
+        return 1;
+
+    dst->engine = src->engine;
+    dst->propOrder = src->propOrder;
+    dst->backtrackLimit = src->backtrackLimit;
+    memcpy(dst->_rng, src->_rng, sizeof dst->_rng);
+#ifdef WFC_METRICS
+    dst->maxResets = src->maxResets;
+#endif
 
-    for (int i = 0; i < wfc->cellCount; i++)
+    if (src->_gridCells > 0 && WFC_SetGrid(dst, &src->_grid))
+        goto clone_error;
+
+    // The merged edges refer to the composites by index
+    if (src->_compositeCount > 0)
     {
-        if (wfc->wave[i].isCollapsed == true)
-            continue;
+        const int partCount = src->_compositeOffsets[src->_compositeCount];
+        dst->_compositeOffsets = WFC_MALLOC((src->_compositeCount + 1) * sizeof dst->_compositeOffsets[0]);
+        dst->_compositeParts = WFC_MALLOC(partCount * sizeof dst->_compositeParts[0]);
+        if (dst->_compositeOffsets == NULL || dst->_compositeParts == NULL)
+            goto clone_error;
+
+        memcpy(dst->_compositeOffsets, src->_compositeOffsets, (src->_compositeCount + 1) * sizeof dst->_compositeOffsets[0]);
+        memcpy(dst->_compositeParts, src->_compositeParts, partCount * sizeof dst->_compositeParts[0]);
+        dst->_compositeCount = src->_compositeCount;
+        dst->_compositePartCap = partCount;
+    }
 
-        double entropy = log(wfc->wave[i].sumWeights) - wfc->wave[i].weightLogWeightSum / wfc->wave[i].sumWeights;
+    for (int i = 0; i < src->cellCount; i++)
+    {
+        if (i >= dst->cellCount && WFC_AddCell(dst) < 0)
+            goto clone_error;
 
-        // Add a tiny random value to the entropy as noise
-        entropy += ((double) rand() / RAND_MAX) * 0.01;
+        dst->_initialTile[i] = src->_initialTile[i];
+        if (i >= src->_adjCells)
+            continue;
 
-        if (entropy < min)
+        for (int e = src->_adjOffsets[i]; e < src->_adjOffsets[i + 1]; e++)
         {
-            min = entropy;
-            arg_min = i;
+            if (WFC__AddToNeighborList(dst, i, src->_adjIdx[e], src->_adjRel[e]))
+                goto clone_error;
         }
     }
+    for (int e = 0; e < src->_newEdgeCount; e++)
+    {
+        if (WFC__PushEdge(dst, src->_newEdges[e]))
+            goto clone_error;
+    }
 
-    if (min == 0)
-        return -1;
+    if (src->_initialMasks != NULL)
+    {
+        dst->_initialMasks = WFC_MALLOC((size_t) dst->_cellCap * dst->tileWords * sizeof dst->_initialMasks[0]);
+        if (dst->_initialMasks == NULL)
+            goto clone_error;
+        memcpy(dst->_initialMasks, src->_initialMasks, (size_t) src->cellCount * src->tileWords * sizeof dst->_initialMasks[0]);
+    }
 
-    if (arg_min != -1)
+    if (WFC__CopyGroups(dst, src))
+        goto clone_error;
+
+    for (int l = 0; l < src->_limitCount; l++)
     {
-        WFC__Collapse(wfc, arg_min);
-#ifdef WFC_METRICS 
-        wfc->totalObservations += 1;
-#endif
+        const WFC_TileLimit* limit = &src->_limits[l];
+        if (WFC_AddTileLimit(dst, limit->group, limit->tile, limit->min, limit->max))
+            goto clone_error;
     }
 
-    return arg_min;
+    for (int c = 0; c < src->_connCount; c++)
+    {
+        if (WFC__AddConnectivity(dst, &src->_connTiles[(size_t) c * src->tileWords], src->_conns[c]))
+            goto clone_error;
+    }
+
+    return 0;
+
+clone_error:
+    WFC_CleanUp(dst);
+    return 1;
 }
 
-int WFC__Propagate(WFC_State* wfc)
+typedef struct
 {
-    assert(wfc->propCount > 0);
-    WFC_Prop p = wfc->props[wfc->propCount-1];
-    wfc->propCount--;
-#ifdef WFC_METRICS 
-    wfc->totalPropagations += 1;
+    WFC_State* model;
+    uint64_t firstSeed;
+    int runCount;
+    int* outTiles;
+#ifdef WFC_THREADS
+    atomic_int nextRun;
+#else
+    int nextRun;
 #endif
+} WFC__Batch;
 
-    WFC_Cell* destCell = &wfc->wave[p.to];
-    WFC_Cell* srcCell = &wfc->wave[p.from];
+typedef struct
+{
+    WFC__Batch* batch;
+    int finished; // Runs that finished, or -1 if the worker couldn't start
+} WFC__BatchWorker;
 
-    WFC_DEBUG_PRINTF("Propagating %d -> %d... ", p.from, p.to);
+static inline int WFC__NextRun(WFC__Batch* batch)
+{
+#ifdef WFC_THREADS
+    return atomic_fetch_add(&batch->nextRun, 1);
+#else
+    return batch->nextRun++;
+#endif
+}
 
-    int newValidCount = destCell->validTileCount;
-    float newSumWeights = destCell->sumWeights;
-    float newSumLogWeights = destCell->weightLogWeightSum;
-    int lastEnabled = -1;
+// Takes runs from the batch until there are none left, reusing one clone of the model for all of them.
+static void* WFC__RunBatchWorker(void* arg)
+{
+    WFC__BatchWorker* worker = arg;
+    WFC__Batch* batch = worker->batch;
+    WFC_State wfc = {0};
 
-    bool changed = false;
-    for (int destTileIdx = 0; destTileIdx < wfc->tileCount; destTileIdx++)
+    worker->finished = 0;
+    if (WFC_Clone(&wfc, batch->model))
     {
-        if (destCell->validTiles[destTileIdx] == false)
-            continue;
+        worker->finished = -1;
+        return NULL;
+    }
 
-        bool isAllowed = false; // will be true if one tile from src allows this tile at dest
-        for (int srcTileIdx = 0; srcTileIdx < wfc->tileCount; srcTileIdx++)
-        {
-            if (srcCell->validTiles[srcTileIdx] == false)
-                continue;
+    for (int run = WFC__NextRun(batch); run < batch->runCount; run = WFC__NextRun(batch))
+    {
+        // Seeding and then resetting makes each run's result depend only on its seed
+        WFC_Seed(&wfc, batch->firstSeed + run);
+        WFC_Reset(&wfc);
+
+        int* out = &batch->outTiles[(size_t) run * wfc.cellCount];
+        bool finished = WFC_Run(&wfc) == WFC_SUCCESS;
+        for (int i = 0; i < wfc.cellCount; i++)
+            out[i] = finished ? wfc._cells[i].collapsedTile : -1;
+        worker->finished += finished;
+    }
 
-            int rel = p.rel;
-            if (wfc->propagator[WFC__PropIdx(wfc, rel, srcTileIdx, destTileIdx)])
-            {
-                isAllowed = true;
-                break;
-            }
-        }
+    WFC_CleanUp(&wfc);
+    return NULL;
+}
 
-        if (isAllowed)
-        {
-            /* destCell->validTiles[destTileIdx] = true; */
-            lastEnabled = destTileIdx;
-        }
-        else
-        {
-            destCell->validTiles[destTileIdx] = false;
-            newValidCount--;
-            newSumWeights -= wfc->tileset[destTileIdx].weight;
-            newSumLogWeights -= wfc->tileset[destTileIdx].weight * log(wfc->tileset[destTileIdx].weight);
-        }
-    }
+// Generates "runCount" outputs from the cells, neighbors, rules and initial tiles of "model",
+// seeding run r with firstSeed + r. The collapsed tiles of run r are written to
+// outTiles[r * cellCount ... (r + 1) * cellCount - 1], all set to -1 if the run failed.
+// Runs are spread over "threadCount" workers when WFC_THREADS is defined, and done in order otherwise.
+// Returns the count of finished runs, or WFC_ERROR if no worker could be set up.
+int WFC_RunBatch(WFC_State* model, uint64_t firstSeed, int runCount, int* outTiles, int threadCount)
+{
+    assert(model != NULL && model->initialized);
+    assert(runCount >= 0 && outTiles != NULL);
 
-    if (newSumWeights != destCell->sumWeights || newValidCount != destCell->validTileCount)
+    // Compile the model's own rules once here, since its clones only reference them
+    if (!model->rules->compiled)
     {
-        if (newValidCount == 0)
-            return 1;
+        if (model->_ownedRules == NULL || WFC_CompileRules(model->_ownedRules))
+            return WFC_ERROR;
+    }
 
-        WFC_DEBUG_PRINTF("Changed valid tiles from %d to %d.\n", destCell->validTileCount, newValidCount);
+    WFC__Batch batch = { model, firstSeed, runCount, outTiles, 0 };
 
-        destCell->validTileCount = newValidCount;
-        destCell->sumWeights = newSumWeights;
-        destCell->weightLogWeightSum = newSumLogWeights;
+#ifdef WFC_THREADS
+    if (threadCount > runCount)
+        threadCount = runCount;
+    if (threadCount < 1)
+        threadCount = 1;
+#else
+    threadCount = 1;
+#endif
 
-        if (destCell->validTileCount == 1)
-        {
-            // FIXME: review this usage
-            WFC__SetCollapsed(wfc, destCell, lastEnabled);
-            return 0;
-            /* destCell->collapsedTile = lastEnabled; */
-            /* destCell->isCollapsed = true; */
-        }
+    WFC__BatchWorker* workers = WFC_MALLOC(threadCount * sizeof workers[0]);
+    if (workers == NULL)
+        return WFC_ERROR;
+    for (int w = 0; w < threadCount; w++)
+        workers[w] = (WFC__BatchWorker) { &batch, 0 };
 
-        for (int n = 0; n < destCell->neighborCount; n++)
-        {
-            if (destCell->neighbors[n].idx == p.from || wfc->wave[destCell->neighbors[n].idx].isCollapsed)
-                continue;
-            WFC__AddProp(wfc, p.to, destCell->neighbors[n].idx, destCell->neighbors[n].rel);
-        }
+#ifdef WFC_THREADS
+    pthread_t* threads = WFC_MALLOC(threadCount * sizeof threads[0]);
+    if (threads == NULL)
+    {
+        WFC_FREE(workers);
+        return WFC_ERROR;
+    }
 
-        /* TraceLog(LOG_INFO, TextFormat("Tile %d was changed by prop.", p.toIdx)); */
+    // The calling thread works too
+    int started = 1;
+    for (; started < threadCount; started++)
+    {
+        if (pthread_create(&threads[started], NULL, WFC__RunBatchWorker, &workers[started]) != 0)
+            break;
     }
-    else
+    WFC__RunBatchWorker(&workers[0]);
+    for (int w = 1; w < started; w++)
+        pthread_join(threads[w], NULL);
+    WFC_FREE(threads);
+#else
+    WFC__RunBatchWorker(&workers[0]);
+#endif
+
+    int finished = 0;
+    bool anyStarted = false;
+    for (int w = 0; w < threadCount; w++)
     {
-        WFC_DEBUG_PRINT("No changes.\n");
+        if (workers[w].finished >= 0)
+        {
+            anyStarted = true;
+            finished += workers[w].finished;
+        }
     }
+    WFC_FREE(workers);
 
-    return 0;
+    return anyStarted ? finished : WFC_ERROR;
 }
 
-int WFC_DoStep(WFC_State* wfc)
+typedef struct
 {
-    assert(wfc != NULL && wfc->initialized);
+    WFC_State* wfc;
+    uint64_t firstSeed;
+    int runCount;
+#ifdef WFC_THREADS
+    atomic_int nextRun;
+    atomic_int winner; // Run whose wave was copied, -1 while there's none
+#else
+    int nextRun;
+    int winner;
+#endif
+} WFC__Portfolio;
+
+// Copies the domains of a finished state into another one with the same cells.
+static void WFC__CopyWave(WFC_State* dst, const WFC_State* src)
+{
+    memcpy(dst->_cells, src->_cells, src->cellCount * sizeof dst->_cells[0]);
+    memcpy(dst->_entropy, src->_entropy, src->cellCount * sizeof dst->_entropy[0]);
+    for (int i = 0; i < src->cellCount; i++)
+        dst->_heapPos[i] = -1;
+
+    memcpy(dst->_domains, src->_domains, (size_t) src->cellCount * src->tileWords * sizeof dst->_domains[0]);
+
+    // Nothing is left to observe, propagate or undo
+    dst->_heapCount = 0;
+    if (dst->_inPropQueue != NULL)
+        memset(dst->_inPropQueue, 0, dst->_propCap * sizeof dst->_inPropQueue[0]);
+    dst->_propHead = dst->propCount = dst->_banCount = 0;
+    dst->_decisionCount = dst->_trailCount = 0;
+    if (dst->_savedLevel != NULL)
+        memset(dst->_savedLevel, 0xFF, dst->cellCount * sizeof dst->_savedLevel[0]);
 
 #ifdef WFC_METRICS
-    if (wfc->maxResets > 0 && wfc->totalResets >= wfc->maxResets)
-    {
-        return WFC_ERROR;
-    }
+    dst->totalIterations += src->totalIterations;
+    dst->totalPropagations += src->totalPropagations;
+    dst->totalObservations += src->totalObservations;
+    dst->totalResets += src->totalResets;
+    dst->totalBacktracks += src->totalBacktracks;
 #endif
+    dst->isFinished = true;
+}
 
-    if (WFC__RefitState(wfc))
-        return WFC_ERROR;
+// Runs seeds until one finishes or another worker wins.
+static void* WFC__RunPortfolioWorker(void* arg)
+{
+    WFC__Portfolio* portfolio = arg;
+    WFC_State wfc = {0};
 
-    int collapsed = WFC__Observe(wfc);
-    if (collapsed < 0)
-    {
-        wfc->isFinished = true;
-        return WFC_SUCCESS;
-    }
+    if (WFC_Clone(&wfc, portfolio->wfc))
+        return NULL;
 
-    while (WFC__PropsLeft(wfc))
+#ifdef WFC_THREADS
+    wfc._cancel = &portfolio->winner;
+    for (int run = atomic_fetch_add(&portfolio->nextRun, 1); run < portfolio->runCount; run = atomic_fetch_add(&portfolio->nextRun, 1))
+#else
+    for (int run = portfolio->nextRun++; run < portfolio->runCount; run = portfolio->nextRun++)
+#endif
     {
-        int err = WFC__Propagate(wfc);
-        if (err)
+        WFC_Seed(&wfc, portfolio->firstSeed + run);
+        WFC_Reset(&wfc);
+        if (WFC_Run(&wfc) != WFC_SUCCESS)
         {
-            WFC__Reset(wfc);
-#ifdef WFC_METRICS 
-            wfc->totalResets += 1;
-#endif
+            if (WFC__Cancelled(&wfc))
+                break;
+            continue;
         }
-    }
 
-#ifdef WFC_METRICS
-    wfc->totalIterations += 1;
+#ifdef WFC_THREADS
+        // The winner's index is stored plus one, so that any win reads as a set cancel flag
+        int none = 0;
+        if (atomic_compare_exchange_strong(&portfolio->winner, &none, run + 1))
+            WFC__CopyWave(portfolio->wfc, &wfc);
+#else
+        portfolio->winner = run + 1;
+        WFC__CopyWave(portfolio->wfc, &wfc);
 #endif
+        break;
+    }
 
-    return 0;
+    WFC_CleanUp(&wfc);
+    return NULL;
 }
 
-int WFC_Run(WFC_State* wfc)
+// Races independent runs of the same state, seeded firstSeed, firstSeed + 1, ..., over "threadCount"
+// workers, cancelling the rest once one of them finishes. Its wave is copied into "wfc".
+// A worker whose run fails moves on to the next seed not taken yet.
+// Without WFC_THREADS, the seeds are tried in order until one finishes.
+// Returns WFC_SUCCESS and sets "winningSeed" (if not NULL), or WFC_ERROR if every run failed.
+int WFC_RunPortfolio(WFC_State* wfc, uint64_t firstSeed, int runCount, int threadCount, uint64_t* winningSeed)
 {
     assert(wfc != NULL && wfc->initialized);
+    assert(runCount > 0);
 
     if (WFC__RefitState(wfc))
         return WFC_ERROR;
 
-    while (WFC__Observe(wfc) >= 0)
+    // Compile the state's own rules once here, since its clones only reference them
+    if (!wfc->rules->compiled)
     {
-        while (WFC__PropsLeft(wfc))
-        {
-            int err = WFC__Propagate(wfc);
-            if (err)
-            {
-                WFC__Reset(wfc);
-#ifdef WFC_METRICS 
-                wfc->totalResets += 1;
-#endif
-            }
+        if (wfc->_ownedRules == NULL || WFC_CompileRules(wfc->_ownedRules))
+            return WFC_ERROR;
+    }
 
-#ifdef WFC_METRICS
-            if (wfc->maxResets > 0 && wfc->totalResets >= wfc->maxResets)
-            {
-                return WFC_ERROR;
-            }
-#endif
-        }
+    WFC__Portfolio portfolio = { wfc, firstSeed, runCount, 0, 0 };
 
-#ifdef WFC_METRICS 
-        wfc->totalIterations += 1;
-#endif
+#ifdef WFC_THREADS
+    if (threadCount > runCount)
+        threadCount = runCount;
+    if (threadCount < 1)
+        threadCount = 1;
+
+    pthread_t* threads = WFC_MALLOC(threadCount * sizeof threads[0]);
+    if (threads == NULL)
+        return WFC_ERROR;
+
+    // The calling thread works too
+    int started = 1;
+    for (; started < threadCount; started++)
+    {
+        if (pthread_create(&threads[started], NULL, WFC__RunPortfolioWorker, &portfolio) != 0)
+            break;
     }
+    WFC__RunPortfolioWorker(&portfolio);
+    for (int t = 1; t < started; t++)
+        pthread_join(threads[t], NULL);
+    WFC_FREE(threads);
 
-    wfc->isFinished = true;
+    int winner = atomic_load(&portfolio.winner) - 1;
+#else
+    (void) threadCount;
+    WFC__RunPortfolioWorker(&portfolio);
+    int winner = portfolio.winner - 1;
+#endif
+
+    if (winner < 0)
+        return WFC_ERROR;
+
+    if (winningSeed != NULL)
+        *winningSeed = firstSeed + winner;
     return WFC_SUCCESS;
 }
 